@@ -0,0 +1,35 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace bench {
+
+// Wall-clock time of f() in milliseconds.
+template <typename F> inline double time_ms(F &&f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  std::chrono::duration<double, std::milli> took =
+      std::chrono::steady_clock::now() - start;
+  return took.count();
+}
+
+// Value of the environment variable name, or fallback when it is not set.
+inline size_t env_size(const char *name, size_t fallback) {
+  const char *value = std::getenv(name);
+  return value ? std::strtoull(value, nullptr, 10) : fallback;
+}
+
+// One machine-readable result line: {"bench":...,"n":...,"metric":value}.
+inline void report(const std::string &name, size_t n, const char *metric,
+                   double value) {
+  std::printf("{\"bench\":\"%s\",\"n\":%zu,\"%s\":%.3f}\n", name.c_str(), n,
+              metric, value);
+}
+
+} // namespace bench
+
+#endif // BENCH_H
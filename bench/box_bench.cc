@@ -0,0 +1,39 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <cassert>
+#include <string>
+
+// Several-kilobyte messages, stored inline and in shared boxes.
+struct message {
+  std::string body;
+};
+struct boxed_message {
+  std::string body;
+};
+template <> struct kvfifo_shared_values<boxed_message> : std::true_type {};
+
+// Time of the detach done by the first push to a copy of a queue of n
+// messages, and of writing through front() of a further copy.
+template <typename M> void run(const char *name, size_t n, size_t bytes) {
+  kvfifo<int, M> q;
+  for (size_t i = 0; i < n; ++i)
+    q.push(static_cast<int>(i % 1024), M{std::string(bytes, 'm')});
+
+  std::string prefix = name;
+  kvfifo<int, M> copy = q;
+  bench::report(prefix + "_detach", n, "ms", bench::time_ms([&] {
+                  copy.push(0, M{"new"});
+                }));
+  kvfifo<int, M> other = q;
+  bench::report(prefix + "_write_front", n, "ms", bench::time_ms([&] {
+                  other.front().second.body[0] = 'w';
+                }));
+  assert(std::as_const(q).front().second.body[0] == 'm');
+}
+
+int main() {
+  size_t n = bench::env_size("BENCH_N", 100'000);
+  size_t bytes = bench::env_size("BENCH_BYTES", 4096);
+  run<message>("inline", n, bytes);
+  run<boxed_message>("boxed", n, bytes);
+}
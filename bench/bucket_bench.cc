@@ -0,0 +1,26 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <cassert>
+#include <malloc.h>
+
+// Heap bytes per element and push throughput for queues whose keys hold
+// 1, 2, 4 and 16 elements each.
+int main() {
+  size_t n = bench::env_size("BENCH_N", 4'000'000);
+
+  for (size_t per_key : {1, 2, 4, 16}) {
+    size_t before = mallinfo2().uordblks;
+    kvfifo<int, int> q;
+    double ms = bench::time_ms([&] {
+      for (size_t i = 0; i < n; ++i)
+        q.push(static_cast<int>(i / per_key), static_cast<int>(i));
+    });
+    size_t used = mallinfo2().uordblks - before;
+    assert(q.size() == n);
+
+    std::string name = "push_" + std::to_string(per_key) + "_per_key";
+    bench::report(name, n, "mops", n / ms / 1000);
+    bench::report(name, n, "heap_bytes_per_element",
+                  static_cast<double>(used) / n);
+  }
+}
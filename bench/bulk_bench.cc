@@ -0,0 +1,38 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <cassert>
+
+// Scaling of count_if and transform_reduce over a const snapshot, both with
+// few keys (kv_list is partitioned) and many keys (the key index is).
+int main() {
+  size_t n = bench::env_size("BENCH_N", 10'000'000);
+  size_t max_threads = bench::env_size("BENCH_THREADS", 32);
+
+  for (size_t keys : {size_t{16}, n / 4}) {
+    kvfifo<int, int> q;
+    for (size_t i = 0; i < n; ++i)
+      q.push(static_cast<int>(i % keys), static_cast<int>(i));
+    const auto &snapshot = q;
+    std::string suffix = keys == 16 ? "_fifo" : "_index";
+
+    for (size_t t = 1; t <= max_threads; t *= 2) {
+      kvfifo_pool pool(t);
+      size_t odd = 0;
+      bench::report("count_if" + suffix + "_t" + std::to_string(t), n, "ms",
+                    bench::time_ms([&] {
+                      odd = snapshot.count_if(
+                          pool, [](int, int v) { return v % 2; });
+                    }));
+      assert(odd == n / 2);
+      long long sum = 0;
+      bench::report(
+          "transform_reduce" + suffix + "_t" + std::to_string(t), n, "ms",
+          bench::time_ms([&] {
+            sum = snapshot.transform_reduce(
+                pool, 0LL, std::plus<long long>{},
+                [](int k, int) { return static_cast<long long>(k); });
+          }));
+      assert(sum > 0);
+    }
+  }
+}
@@ -0,0 +1,115 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Checkpoint and restore of kvfifo<int, int> and
+// kvfifo<std::string, std::vector<char>> from 1k up to BENCH_MAX elements,
+// 10M by default. Every size runs in three fresh processes, so that peak
+// RSS is that of one side alone: the first builds the queue and serializes
+// it to a file, the second restores it from the file through a stream and
+// the third from a mapping of it, each reading front().
+static double peak_rss_mb() {
+  rusage usage;
+  ::getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+}
+
+// Runs f in a child process and waits for it.
+template <typename F> void isolated(F &&f) {
+  std::fflush(stdout);
+  if (::fork() == 0) {
+    f();
+    std::fflush(stdout);
+    ::_exit(0);
+  }
+  ::wait(nullptr);
+}
+
+template <typename K, typename V, typename Make>
+void run(const std::string &name, size_t n, const std::string &path,
+         Make &&make) {
+  isolated([&] {
+    kvfifo<K, V> q;
+    for (size_t i = 0; i < n; ++i) {
+      auto [key, val] = make(i);
+      q.push(key, val);
+    }
+    double ms = bench::time_ms([&] {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      q.serialize(out);
+    });
+    struct stat st;
+    ::stat(path.c_str(), &st);
+    double mb = st.st_size / 1e6;
+    bench::report(name + "_bytes", n, "bytes", static_cast<double>(st.st_size));
+    bench::report(name + "_serialize", n, "ms", ms);
+    bench::report(name + "_serialize", n, "mb_per_s", mb / ms * 1e3);
+    bench::report(name + "_serialize_peak_rss", n, "mb", peak_rss_mb());
+  });
+
+  isolated([&] {
+    double mb = 0;
+    kvfifo<K, V> q; // freed after the timed part
+    double ms = bench::time_ms([&] {
+      std::ifstream in(path, std::ios::binary);
+      q = kvfifo<K, V>::deserialize(in);
+      mb = static_cast<double>(in.tellg()) / 1e6;
+      if (!q.empty())
+        (void)q.front();
+    });
+    bench::report(name + "_restore_stream_to_front", n, "ms", ms);
+    bench::report(name + "_deserialize_stream", n, "mb_per_s",
+                  mb / ms * 1e3);
+    bench::report(name + "_restore_stream_peak_rss", n, "mb", peak_rss_mb());
+  });
+
+  isolated([&] {
+    double mb = 0;
+    kvfifo<K, V> q;
+    double ms = bench::time_ms([&] {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      struct stat st;
+      ::fstat(fd, &st);
+      size_t bytes = static_cast<size_t>(st.st_size);
+      void *p = ::mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      q = kvfifo<K, V>::deserialize(p, bytes);
+      ::munmap(p, bytes);
+      mb = bytes / 1e6;
+      if (!q.empty())
+        (void)q.front();
+    });
+    bench::report(name + "_restore_mmap_to_front", n, "ms", ms);
+    bench::report(name + "_deserialize_mmap", n, "mb_per_s", mb / ms * 1e3);
+    bench::report(name + "_restore_mmap_peak_rss", n, "mb", peak_rss_mb());
+  });
+}
+
+int main() {
+  size_t max = bench::env_size("BENCH_MAX", 10'000'000);
+  std::string path =
+      "/tmp/kvfifo_checkpoint_bench_" + std::to_string(::getpid());
+
+  for (size_t n = 1000; n <= max; n *= 10) {
+    run<int, int>("int_int", n, path, [](size_t i) {
+      return std::pair<int, int>(static_cast<int>(i % 10'000),
+                                 static_cast<int>(i));
+    });
+    // 10k distinct keys, values of 8 to 39 bytes
+    run<std::string, std::vector<char>>("string_bytes", n, path, [](size_t i) {
+      return std::pair<std::string, std::vector<char>>(
+          "key-" + std::to_string(i % 10'000),
+          std::vector<char>(8 + i % 32, static_cast<char>(i)));
+    });
+  }
+  ::unlink(path.c_str());
+}
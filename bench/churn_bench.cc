@@ -0,0 +1,41 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <cassert>
+#include <cstdint>
+#include <string>
+
+// Key churn soak: every operation pushes an element with a new session id
+// and pops, by key, the session pushed BENCH_LIVE operations earlier, so
+// BENCH_N keys pass through a queue holding BENCH_LIVE of them. After
+// every tenth of the run it reports the memory held by the state, the
+// number of keys in the index and the time of a k_begin()..k_end() walk,
+// all of which should stay flat.
+int main() {
+  size_t n = bench::env_size("BENCH_N", 100'000'000);
+  size_t live = bench::env_size("BENCH_LIVE", 100'000);
+  size_t window = std::max<size_t>(n / 10, 1);
+
+  kvfifo<uint64_t, uint64_t> q;
+  for (size_t done = 0; done < n;) {
+    double ms = bench::time_ms([&] {
+      for (size_t end = std::min(n, done + window); done < end; ++done) {
+        q.push(done, done);
+        if (done >= live)
+          q.pop(done - live);
+      }
+    });
+    size_t keys = 0;
+    uint64_t sum = 0;
+    double walk = bench::time_ms([&] {
+      for (auto k = q.k_begin(); k != q.k_end(); ++k, ++keys)
+        sum += *k;
+    });
+    std::string at = "churn_" + std::to_string(done);
+    bench::report(at + "_ops", window, "ms", ms);
+    bench::report(at + "_state_bytes", done, "bytes",
+                  static_cast<double>(q.memory_usage().total()));
+    bench::report(at + "_keys", done, "keys", static_cast<double>(keys));
+    bench::report(at + "_key_walk", done, "ms", walk);
+    assert(keys == std::min(done, live) && sum >= keys * (keys - 1) / 2);
+  }
+}
@@ -0,0 +1,28 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <cassert>
+
+// Serial detach (what copy() does) against clone(pool) at 1M and 10M
+// elements. Sizes can be overridden with BENCH_SIZES_MAX, threads with
+// BENCH_THREADS.
+int main() {
+  size_t threads = bench::env_size("BENCH_THREADS", 8);
+  size_t max_n = bench::env_size("BENCH_SIZES_MAX", 10'000'000);
+  kvfifo_pool serial(1);
+  kvfifo_pool pool(threads);
+
+  for (size_t n = 1'000'000; n <= max_n; n *= 10) {
+    kvfifo<int, int> q;
+    for (size_t i = 0; i < n; ++i)
+      q.push(static_cast<int>(i % 4096), static_cast<int>(i));
+
+    kvfifo<int, int> copy;
+    bench::report("clone_serial", n, "ms",
+                  bench::time_ms([&] { copy = q.clone(serial); }));
+    assert(copy.size() == n);
+    copy.clear();
+    bench::report("clone_parallel_t" + std::to_string(threads), n, "ms",
+                  bench::time_ms([&] { copy = q.clone(pool); }));
+    assert(copy.size() == n && copy.count(7) == q.count(7));
+  }
+}
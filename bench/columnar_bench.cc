@@ -0,0 +1,63 @@
+#include "../kvfifo_columnar.h"
+#include "bench.h"
+#include <sstream>
+#include <string>
+
+// Size and speed of the columnar format against serialize(), row by row
+// and indexed, for n elements of integers and of short strings.
+template <typename K, typename V, typename F>
+void run(const std::string &name, size_t n, F &&element) {
+  kvfifo<K, V> q;
+  for (size_t i = 0; i < n; ++i) {
+    auto [key, val] = element(i);
+    q.push(key, val);
+  }
+  K probe = q.front().first;
+
+  std::ostringstream rows, indexed, columns;
+  q.serialize(rows, false);
+  q.serialize(indexed, true);
+  bench::report(name + "_columnar_write", n, "ms", bench::time_ms([&] {
+                  kvfifo_columnar<K, V>::write(columns, q);
+                }));
+  std::string r = rows.str(), x = indexed.str(), c = columns.str();
+  bench::report(name + "_rows_bytes", n, "bytes", r.size());
+  bench::report(name + "_indexed_bytes", n, "bytes", x.size());
+  bench::report(name + "_columnar_bytes", n, "bytes", c.size());
+  bench::report(name + "_rows_to_columnar", n, "x",
+                static_cast<double>(r.size()) / c.size());
+
+  bench::report(name + "_columnar_read", n, "ms", bench::time_ms([&] {
+                  std::istringstream in(c);
+                  kvfifo_columnar<K, V>::read(in);
+                }));
+  bench::report(name + "_rows_read", n, "ms", bench::time_ms([&] {
+                  std::istringstream in(r);
+                  kvfifo<K, V>::deserialize(in);
+                }));
+  bench::report(name + "_columnar_count", n, "ms", bench::time_ms([&] {
+                  std::istringstream in(c);
+                  kvfifo_columnar<K, V>::count(in, probe);
+                }));
+  bench::report(name + "_rows_read_count", n, "ms", bench::time_ms([&] {
+                  std::istringstream in(r);
+                  kvfifo<K, V>::deserialize(in).count(probe);
+                }));
+}
+
+int main() {
+  size_t n = bench::env_size("BENCH_N", 1'000'000);
+  // readings of 1000 sensors, stamped in increasing order
+  run<int, long>("ints", n, [](size_t i) {
+    return std::pair<int, long>(static_cast<int>(i % 1000),
+                                1'700'000'000'000L + static_cast<long>(i) * 10 +
+                                    static_cast<long>(i * 7 % 10));
+  });
+  // status updates of 1000 users
+  const char *status[] = {"ok", "pending", "failed", "retry",
+                          "done", "queued", "late", "cancelled"};
+  run<std::string, std::string>("strings", n, [&](size_t i) {
+    return std::pair<std::string, std::string>(
+        "user-" + std::to_string(i * 7919 % 1000), status[i * 31 % 8]);
+  });
+}
@@ -0,0 +1,39 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <sstream>
+
+// Cost of shipping a copy of a queue of n elements that differs from its
+// base by c pushes and c pops: diff() and apply() against serialize().
+int main() {
+  size_t n = bench::env_size("BENCH_N", 1'000'000);
+  size_t c = bench::env_size("BENCH_CHANGES", 100);
+
+  kvfifo<int, long> base;
+  for (size_t i = 0; i < n; ++i)
+    base.push(static_cast<int>(i % 1024), static_cast<long>(i));
+
+  kvfifo<int, long> same = base;
+  bench::report("diff_shared", n, "ms", bench::time_ms([&] {
+                  kvfifo<int, long>::diff(base, same);
+                }));
+
+  kvfifo<int, long> updated = base;
+  for (size_t i = 0; i < c; ++i) {
+    updated.pop();
+    updated.push(static_cast<int>(i % 7), -static_cast<long>(i));
+  }
+  kvfifo<int, long>::delta d;
+  bench::report("diff", n, "ms", bench::time_ms([&] {
+                  d = kvfifo<int, long>::diff(base, updated);
+                }));
+  bench::report("edits", n, "count", static_cast<double>(d.edits.size()));
+  kvfifo<int, long> replica; // a base of its own, as on another host
+  for (size_t i = 0; i < n; ++i)
+    replica.push(static_cast<int>(i % 1024), static_cast<long>(i));
+  bench::report("apply", n, "ms",
+                bench::time_ms([&] { replica.apply(d); }));
+  bench::report("serialize", n, "ms", bench::time_ms([&] {
+                  std::ostringstream out;
+                  updated.serialize(out);
+                }));
+}
@@ -0,0 +1,39 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <cassert>
+#include <cstdint>
+
+// push, first/last/count lookups and pop(key) with uint16_t keys, which use
+// the flat kvfifo_direct_map, against the same keys as int in a std::map.
+template <typename K> void run(const char *name, size_t n, size_t keys) {
+  kvfifo<K, int> q;
+  const auto &cq = q;
+  std::string prefix = name;
+
+  bench::report(prefix + "_push", n, "ms", bench::time_ms([&] {
+                  for (size_t i = 0; i < n; ++i)
+                    q.push(static_cast<K>(i * 7919 % keys),
+                           static_cast<int>(i));
+                }));
+  long long sum = 0;
+  bench::report(prefix + "_first_last_count", n, "ms", bench::time_ms([&] {
+                  for (size_t i = 0; i < n; ++i) {
+                    K key = static_cast<K>(i % keys);
+                    sum += cq.first(key).second + cq.last(key).second +
+                           cq.count(key);
+                  }
+                }));
+  bench::report(prefix + "_pop_key", n, "ms", bench::time_ms([&] {
+                  for (size_t i = 0; i < n; ++i)
+                    q.pop(static_cast<K>(i % keys));
+                }));
+  assert(q.empty() && sum > 0);
+}
+
+int main() {
+  size_t n = bench::env_size("BENCH_N", 4'000'000);
+  size_t keys = bench::env_size("BENCH_KEYS", 4096);
+  n = n / keys * keys; // every key gets the same number of elements
+  run<uint16_t>("direct_uint16", n, keys);
+  run<int>("std_map_int", n, keys);
+}
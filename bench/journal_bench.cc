@@ -0,0 +1,44 @@
+#include "../kvfifo_journal.h"
+#include "bench.h"
+#include <string>
+
+#include <unistd.h>
+
+// Per-operation cost of n pushes, pops and moves on a kvfifo<int, int>,
+// plain and journaled under each fsync policy, and of replaying the log.
+template <typename Q> void ops(Q &q, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    int key = static_cast<int>(i % 1024);
+    q.push(key, static_cast<int>(i));
+    if (i % 4 == 3)
+      q.move_to_back(key);
+    if (i % 2 == 1)
+      q.pop();
+  }
+}
+
+int main() {
+  size_t n = bench::env_size("BENCH_N", 1'000'000);
+  std::string path = "/tmp/kvfifo_journal_bench_" + std::to_string(::getpid());
+
+  kvfifo<int, int> plain;
+  bench::report("plain", n, "ns_per_op",
+                bench::time_ms([&] { ops(plain, n); }) * 1e6 / n);
+
+  const std::pair<const char *, kvfifo_fsync> policies[] = {
+      {"journal_never", kvfifo_fsync::never},
+      {"journal_interval", kvfifo_fsync::interval},
+      {"journal_every_commit", kvfifo_fsync::every_commit},
+  };
+  for (auto [name, fsync] : policies) {
+    ::unlink(path.c_str());
+    bench::report(name, n, "ns_per_op", bench::time_ms([&] {
+                    kvfifo_journaled<int, int> q(path, {.fsync = fsync});
+                    ops(q, n);
+                  }) * 1e6 / n);
+  }
+  bench::report("replay", n, "ns_per_op", bench::time_ms([&] {
+                  kvfifo_journaled<int, int>::replay(path);
+                }) * 1e6 / n);
+  ::unlink(path.c_str());
+}
@@ -0,0 +1,47 @@
+#include "../kvfifo.h"
+#include "../kvfifo_mapped.h"
+#include "bench.h"
+#include <cassert>
+#include <string>
+#include <unistd.h>
+
+// push and pop through a file-backed kvfifo_mapped against the in-memory
+// kvfifo, plus the bytes each needs per element. The file is created in
+// BENCH_DIR, /tmp by default, and removed afterwards.
+int main() {
+  size_t n = bench::env_size("BENCH_N", 4'000'000);
+  size_t keys = bench::env_size("BENCH_KEYS", 4096);
+  const char *dir = std::getenv("BENCH_DIR");
+  std::string path = std::string(dir ? dir : "/tmp") + "/kvfifo_bench_" +
+                     std::to_string(::getpid());
+
+  {
+    kvfifo_mapped<long, long> q(path);
+    bench::report("mapped_push", n, "ms", bench::time_ms([&] {
+                    for (size_t i = 0; i < n; ++i)
+                      q.push(static_cast<long>(i * 7919 % keys),
+                             static_cast<long>(i));
+                  }));
+    bench::report("mapped_bytes_per_element", n, "bytes",
+                  static_cast<double>(q.used_bytes()) / n);
+    bench::report("mapped_pop", n, "ms", bench::time_ms([&] {
+                    for (size_t i = 0; i < n; ++i)
+                      q.pop();
+                  }));
+    assert(q.empty());
+  }
+  ::unlink(path.c_str());
+
+  kvfifo<long, long> q;
+  bench::report("memory_push", n, "ms", bench::time_ms([&] {
+                  for (size_t i = 0; i < n; ++i)
+                    q.push(static_cast<long>(i * 7919 % keys),
+                           static_cast<long>(i));
+                }));
+  bench::report("memory_bytes_per_element", n, "bytes",
+                static_cast<double>(q.memory_usage().total()) / n);
+  bench::report("memory_pop", n, "ms", bench::time_ms([&] {
+                  for (size_t i = 0; i < n; ++i)
+                    q.pop();
+                }));
+}
@@ -0,0 +1,40 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <cassert>
+#include <utility>
+#include <vector>
+
+// Restoring n elements from a vector of pairs, by replaying pushes and by
+// the range constructor, for keys in runs (grouped) and scattered.
+int main() {
+  size_t n = bench::env_size("BENCH_N", 10'000'000);
+  size_t keys = bench::env_size("BENCH_KEYS", 100'000);
+
+  for (bool grouped : {true, false}) {
+    std::vector<std::pair<int, int>> pairs(n);
+    for (size_t i = 0; i < n; ++i) {
+      size_t key = grouped ? i * keys / n : i * 7919 % keys;
+      pairs[i] = {static_cast<int>(key), static_cast<int>(i)};
+    }
+    std::string suffix = grouped ? "_grouped" : "_scattered";
+
+    // the queues are freed outside of the timed part
+    kvfifo<int, int> pushed, built, slabs;
+    double push_ms = bench::time_ms([&] {
+      for (const auto &[key, val] : pairs)
+        pushed.push(key, val);
+    });
+    double range_ms = bench::time_ms(
+        [&] { built = kvfifo<int, int>(pairs.begin(), pairs.end()); });
+    double slabs_ms = bench::time_ms([&] {
+      slabs = kvfifo<int, int>(pairs.begin(), pairs.end(),
+                               kvfifo_bounds{.huge_pages = true});
+    });
+    assert(pushed.size() == n && built.size() == n && slabs.size() == n);
+    bench::report("push" + suffix, n, "ms", push_ms);
+    bench::report("range" + suffix, n, "ms", range_ms);
+    bench::report("range_huge_pages" + suffix, n, "ms", slabs_ms);
+    bench::report("speedup" + suffix, n, "x", push_ms / range_ms);
+    bench::report("speedup_huge_pages" + suffix, n, "x", push_ms / slabs_ms);
+  }
+}
@@ -0,0 +1,63 @@
+#include "../kvfifo_replication.h"
+#include "bench.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A primary process doing n operations, pushes stamped with the time they
+// were made and pops keeping the queue at 1000 elements, and a follower
+// process mirroring it through a local socket. The follower reports the
+// throughput it applied at and how far behind it was after each frame.
+static long now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int main() {
+  size_t n = bench::env_size("BENCH_N", 2'000'000);
+  size_t batch = bench::env_size("BENCH_BATCH", 1 << 16);
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return 1;
+
+  if (::fork() == 0) {
+    ::close(fds[0]);
+    kvfifo_replicated<int, long> primary(fds[1], {.batch_bytes = batch});
+    for (size_t i = 0; i < n; ++i) {
+      if (primary.size() >= 1000)
+        primary.pop();
+      else
+        primary.push(static_cast<int>(i % 64), now_ns());
+    }
+    primary.flush();
+    ::close(fds[1]);
+    ::_exit(0);
+  }
+  ::close(fds[1]);
+
+  kvfifo_follower<int, long> follower(fds[0]);
+  size_t frames = 0;
+  double lag_sum = 0, lag_max = 0;
+  long start = now_ns();
+  while (follower.receive()) {
+    ++frames;
+    if (!follower.empty()) {
+      double lag = (now_ns() - follower.elements().back().second) / 1e3;
+      lag_sum += lag;
+      lag_max = std::max(lag_max, lag);
+    }
+  }
+  double ms = (now_ns() - start) / 1e6;
+  ::wait(nullptr);
+
+  bench::report("ops_per_s", n, "ops", follower.applied() / ms * 1e3);
+  bench::report("frames", n, "count", static_cast<double>(frames));
+  bench::report("lag_mean", n, "us", lag_sum / frames);
+  bench::report("lag_max", n, "us", lag_max);
+  return follower.applied() == n ? 0 : 1;
+}
@@ -0,0 +1,101 @@
+#include "../kvfifo_shm.h"
+#include "bench.h"
+#include <mutex>
+#include <string>
+
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// One producer process handing n (key, value) pairs of 16 bytes to c
+// consumer processes, through a kvfifo_shared and, for comparison, through
+// a pipe with one write per pair. A pair with key -1 stops a consumer.
+struct pair_t {
+  long key, val;
+};
+
+template <typename F> void spawn(size_t c, F &&consume) {
+  for (size_t i = 0; i < c; ++i)
+    if (::fork() == 0) {
+      consume();
+      ::_exit(0);
+    }
+}
+
+void reap(size_t c) {
+  for (size_t i = 0; i < c; ++i)
+    ::wait(nullptr);
+}
+
+double shm(size_t n, size_t c) {
+  std::string name = "/kvfifo_shm_bench_" + std::to_string(::getpid());
+  kvfifo_shm_region::remove(name);
+  kvfifo_shared<long, long> q(name, size_t{16} << 20);
+  double ms = bench::time_ms([&] {
+    spawn(c, [&] {
+      kvfifo_shared<long, long> other(name);
+      long sum = 0;
+      for (;;) {
+        std::unique_lock lock(other.storage());
+        if (other.empty()) {
+          lock.unlock();
+          ::sched_yield();
+          continue;
+        }
+        auto [key, val] = other.front(); // read in place
+        bool stop = key == -1;
+        sum += val;
+        other.pop();
+        if (stop)
+          break;
+      }
+      (void)sum;
+    });
+    for (size_t i = 0; i < n + c; ++i) {
+      long key = i < n ? static_cast<long>(i % 1024) : -1;
+      for (;;) {
+        std::lock_guard lock(q.storage());
+        try {
+          q.push(key, static_cast<long>(i));
+          break;
+        } catch (const std::length_error &) {
+        }
+      }
+    }
+    reap(c);
+  });
+  kvfifo_shm_region::remove(name);
+  return ms;
+}
+
+double pipe(size_t n, size_t c) {
+  int fds[2];
+  if (::pipe(fds) != 0)
+    return 0;
+  double ms = bench::time_ms([&] {
+    spawn(c, [&] {
+      ::close(fds[1]);
+      pair_t p;
+      long sum = 0;
+      while (::read(fds[0], &p, sizeof(p)) == sizeof(p) && p.key != -1)
+        sum += p.val;
+      (void)sum;
+    });
+    for (size_t i = 0; i < n + c; ++i) {
+      pair_t p{i < n ? static_cast<long>(i % 1024) : -1, static_cast<long>(i)};
+      if (::write(fds[1], &p, sizeof(p)) != sizeof(p))
+        break;
+    }
+    reap(c);
+  });
+  ::close(fds[0]);
+  ::close(fds[1]);
+  return ms;
+}
+
+int main() {
+  size_t n = bench::env_size("BENCH_N", 1'000'000);
+  size_t c = bench::env_size("BENCH_CONSUMERS", 3);
+  bench::report("shm", n, "ns_per_pair", shm(n, c) * 1e6 / n);
+  bench::report("pipe", n, "ns_per_pair", pipe(n, c) * 1e6 / n);
+}
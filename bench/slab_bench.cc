@@ -0,0 +1,118 @@
+#include "../kvfifo.h"
+#include "bench.h"
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware counter read around a measured section, or nothing where
+// perf_event_open is not permitted.
+class counter {
+private:
+  int fd;
+
+public:
+  counter(uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+  ~counter() {
+    if (fd >= 0)
+      ::close(fd);
+  }
+
+  bool available() const { return fd >= 0; }
+  void start() {
+    if (fd >= 0) {
+      ::ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ::ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  uint64_t stop() {
+    uint64_t value = 0;
+    if (fd >= 0) {
+      ::ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (::read(fd, &value, sizeof(value)) != sizeof(value))
+        value = 0;
+    }
+    return value;
+  }
+};
+
+// Runs f, reporting its time and, if available, dTLB load misses and
+// cycles.
+template <typename F> void measure(const std::string &name, size_t n, F &&f) {
+  counter tlb(PERF_TYPE_HW_CACHE,
+              PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  counter cycles(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  tlb.start();
+  cycles.start();
+  double ms = bench::time_ms(f);
+  uint64_t misses = tlb.stop();
+  uint64_t cycle_count = cycles.stop();
+  bench::report(name, n, "ms", ms);
+  if (tlb.available())
+    bench::report(name + "_dtlb_misses", n, "count",
+                  static_cast<double>(misses));
+  if (cycles.available())
+    bench::report(name + "_cycles", n, "count",
+                  static_cast<double>(cycle_count));
+}
+
+// Anonymous memory of the process backed by transparent huge pages, MiB.
+double anon_huge_mb() {
+  std::ifstream in("/proc/self/smaps_rollup");
+  std::string field;
+  size_t kb = 0;
+  while (in >> field)
+    if (field == "AnonHugePages:" && in >> kb)
+      break;
+  return static_cast<double>(kb) / 1024;
+}
+
+// Traversal and move_to_back over a queue whose list order was shuffled by
+// earlier move_to_back calls, with nodes from the general heap and from
+// huge page slabs.
+void run(const char *name, kvfifo_bounds bounds, size_t n, size_t keys) {
+  kvfifo<long, long> q(bounds);
+  for (size_t i = 0; i < n; ++i)
+    q.push(static_cast<long>(i * 7919 % keys), static_cast<long>(i));
+  for (size_t i = 0; i < keys; ++i)
+    q.move_to_back(static_cast<long>(i * 104729 % keys));
+
+  std::string prefix = name;
+  kvfifo_pool pool(1);
+  size_t odd = 0;
+  measure(prefix + "_traverse", n, [&] {
+    odd = q.count_if(pool, [](long, long val) { return val & 1; });
+  });
+  measure(prefix + "_move_to_back", n, [&] {
+    for (size_t i = 0; i < keys; ++i)
+      q.move_to_back(static_cast<long>(i * 15485863 % keys));
+  });
+  bench::report(prefix + "_slab_mb", n, "mb",
+                static_cast<double>(q.memory_usage().slab_bytes) / (1 << 20));
+  bench::report(prefix + "_anon_huge_mb", n, "mb", anon_huge_mb());
+  assert(odd == n / 2);
+}
+
+int main() {
+  size_t n = bench::env_size("BENCH_N", 4'000'000);
+  size_t keys = bench::env_size("BENCH_KEYS", 65536);
+  run("heap", {}, n, keys);
+  run("huge_pages", {.huge_pages = true}, n, keys);
+}
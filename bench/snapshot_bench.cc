@@ -0,0 +1,49 @@
+#include "../kvfifo_snapshot.h"
+#include "bench.h"
+#include <sstream>
+#include <string>
+
+#include <unistd.h>
+
+// What a snapshot of a queue of n elements costs its owner: serializing in
+// the foreground, detaching from a copy shared with a writer thread, and
+// starting a forked snapshot then mutating while it is written.
+void mutate(kvfifo<int, int> &q, size_t m) {
+  for (size_t i = 0; i < m; ++i) {
+    q.pop();
+    q.push(static_cast<int>(i % 1024), static_cast<int>(i));
+  }
+}
+
+int main() {
+  size_t n = bench::env_size("BENCH_N", 1'000'000);
+  size_t m = bench::env_size("BENCH_M", 100'000);
+  std::string path = "/tmp/kvfifo_snapshot_bench_" + std::to_string(::getpid());
+
+  kvfifo<int, int> q;
+  for (size_t i = 0; i < n; ++i)
+    q.push(static_cast<int>(i % 1024), static_cast<int>(i));
+
+  bench::report("foreground_serialize", n, "ms", bench::time_ms([&] {
+                  std::ostringstream out;
+                  q.serialize(out);
+                }));
+
+  {
+    kvfifo<int, int> shared = q;
+    bench::report("shared_copy_first_push", n, "ms",
+                  bench::time_ms([&] { q.push(0, 0); }));
+  }
+  bench::report("mutations_alone", m, "ms",
+                bench::time_ms([&] { mutate(q, m); }));
+
+  kvfifo_snapshot snap;
+  bench::report("fork_start", n, "ms",
+                bench::time_ms([&] { snap = kvfifo_snapshot(q, path); }));
+  bench::report("fork_first_push", n, "ms",
+                bench::time_ms([&] { q.push(0, 0); }));
+  bench::report("mutations_during_fork", m, "ms",
+                bench::time_ms([&] { mutate(q, m); }));
+  bench::report("fork_wait", n, "ms", bench::time_ms([&] { snap.wait(); }));
+  ::unlink(path.c_str());
+}
@@ -0,0 +1,84 @@
+#include "../kvfifo_steal.h"
+#include "bench.h"
+#include <algorithm>
+#include <cassert>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::atomic<size_t> done{0};
+
+// a little work per task, heavier for some keys to unbalance the workers
+void work(int key) {
+  volatile unsigned x = 0;
+  for (int i = 0; i < (key % 8 == 0 ? 4000 : 500); ++i)
+    x = x + i;
+  done.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Baseline: one kvfifo behind one mutex shared by all threads.
+double shared_queue(size_t threads, size_t tasks, int keys) {
+  kvfifo<int, int> q;
+  std::mutex mutex;
+  return bench::time_ms([&] {
+    for (size_t i = 0; i < tasks; ++i)
+      q.push(static_cast<int>(i % keys), static_cast<int>(i));
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < threads; ++t)
+      pool.emplace_back([&] {
+        for (;;) {
+          int key;
+          {
+            std::lock_guard lock(mutex);
+            if (q.empty())
+              return;
+            key = std::as_const(q).front().first;
+            q.pop();
+          }
+          work(key);
+        }
+      });
+    for (auto &thread : pool)
+      thread.join();
+  });
+}
+
+double stealing_pool(size_t threads, size_t tasks, int keys) {
+  kvfifo_stealing_pool<int> pool(threads);
+  return bench::time_ms([&] {
+    for (size_t i = 0; i < tasks; ++i) {
+      int key = static_cast<int>(i % keys);
+      pool.submit(key, [key] { work(key); });
+    }
+    pool.wait();
+  });
+}
+
+} // namespace
+
+// Best of BENCH_RUNS runs, since scheduling makes single runs noisy.
+int main() {
+  size_t tasks = bench::env_size("BENCH_N", 1'000'000);
+  size_t max_threads = bench::env_size("BENCH_THREADS", 16);
+  int keys = static_cast<int>(bench::env_size("BENCH_KEYS", 64));
+  size_t runs = std::max<size_t>(bench::env_size("BENCH_RUNS", 3), 1);
+
+  auto best = [&](auto &&run) {
+    double ms = 0;
+    for (size_t r = 0; r < runs; ++r) {
+      done = 0;
+      double took = run();
+      assert(done == tasks);
+      ms = r == 0 ? took : std::min(ms, took);
+    }
+    return ms;
+  };
+  for (size_t t = 1; t <= max_threads; t *= 2) {
+    bench::report("shared_locked_t" + std::to_string(t), tasks, "ms",
+                  best([&] { return shared_queue(t, tasks, keys); }));
+    bench::report("work_stealing_t" + std::to_string(t), tasks, "ms",
+                  best([&] { return stealing_pool(t, tasks, keys); }));
+  }
+}
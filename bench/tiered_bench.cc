@@ -0,0 +1,59 @@
+#include "../kvfifo.h"
+#include "../kvfifo_tiered.h"
+#include "bench.h"
+#include <cassert>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+// Resident set size of the process in MiB.
+double rss_mb() {
+  size_t pages = 0, resident = 0;
+  std::ifstream("/proc/self/statm") >> pages >> resident;
+  return static_cast<double>(resident * ::sysconf(_SC_PAGESIZE)) /
+         (1 << 20);
+}
+
+// A backlog of BENCH_N elements in kvfifo_tiered with a budget of
+// BENCH_BUDGET elements in memory, then steady traffic that pops from the
+// front and pushes to the back. Reports the resident set against the budget
+// and against the same backlog in a plain kvfifo, measured last.
+int main() {
+  size_t n = bench::env_size("BENCH_N", 4'000'000);
+  size_t budget = bench::env_size("BENCH_BUDGET", 100'000);
+  size_t keys = bench::env_size("BENCH_KEYS", 4096);
+  char dir[] = "/tmp/kvfifo_bench_XXXXXX";
+  if (!::mkdtemp(dir))
+    return 1;
+
+  double base = rss_mb();
+  {
+    kvfifo_tiered<long, long> q(dir, budget);
+    bench::report("tiered_push", n, "ms", bench::time_ms([&] {
+                    for (size_t i = 0; i < n; ++i)
+                      q.push(static_cast<long>(i % keys),
+                             static_cast<long>(i));
+                  }));
+    double peak = 0;
+    bench::report("tiered_steady", n, "ms", bench::time_ms([&] {
+                    for (size_t i = 0; i < n; ++i) {
+                      q.pop();
+                      q.push(static_cast<long>(i % keys),
+                             static_cast<long>(i));
+                      if (i % 65536 == 0)
+                        peak = std::max(peak, rss_mb() - base);
+                    }
+                  }));
+    bench::report("tiered_budget_mb", budget, "mb",
+                  static_cast<double>(budget) * 2 * sizeof(long) / (1 << 20));
+    bench::report("tiered_steady_rss_mb", n, "mb", peak);
+    assert(q.size() == n && q.memory_size() <= budget);
+  }
+  ::rmdir(dir);
+
+  base = rss_mb();
+  kvfifo<long, long> q;
+  for (size_t i = 0; i < n; ++i)
+    q.push(static_cast<long>(i % keys), static_cast<long>(i));
+  bench::report("memory_rss_mb", n, "mb", rss_mb() - base);
+}
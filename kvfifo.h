@@ -1,33 +1,1025 @@
 #ifndef KVFIFO_H
 #define KVFIFO_H
 
+#include "kvfifo_arena.h"
+#include "kvfifo_codec.h"
+#include "kvfifo_pool.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <iterator>
 #include <list>
 #include <map>
 #include <memory>
+#include <optional>
+#include <ranges>
+#include <set>
+#include <sstream>
 #include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Whether kvfifo<K, V> indexes keys by value in a flat table
+// (kvfifo_direct_map) instead of a std::map. True for integral types other
+// than bool and for enums, when they are at most 16 bits wide; specialize
+// to opt out.
+template <typename K>
+struct kvfifo_direct_index
+    : std::bool_constant<((std::is_integral_v<K> &&
+                           !std::is_same_v<K, bool>) ||
+                          std::is_enum_v<K>) &&
+                         sizeof(K) <= 2> {};
+
+// Whether kvfifo<K, V> keeps every value in an immutable reference-counted
+// box that copies of the queue share. Copying the state then copies
+// pointers instead of values, and a value is only copied when it is
+// reached through a non-const accessor while another state holds it. False
+// by default; specialize for large values that are rarely written.
+template <typename V> struct kvfifo_shared_values : std::false_type {};
+
+// Map from a small integral or enum key to T, with the subset of the
+// std::map interface kvfifo uses. Values live in pages of page_size slots
+// indexed by the key, allocated on first use and kept until the map dies;
+// a bitmap of occupied keys, summarised one bit per word, lets iteration
+// skip empty slots with count-trailing/leading-zeros. Lookups, insertion
+// and erasure are O(1), ++ and -- O(range / 4096) in the worst case.
+template <typename K, typename T> class kvfifo_direct_map {
+public:
+  struct value_type {
+    K first; // set when the page is allocated, never changed
+    T second;
+  };
+
+private:
+  using underlying_t =
+      typename std::conditional_t<std::is_enum_v<K>, std::underlying_type<K>,
+                                  std::type_identity<K>>::type;
+  using unsigned_t = std::make_unsigned_t<underlying_t>;
+
+  static constexpr uint32_t bits = 8 * sizeof(K);
+  static constexpr uint32_t range = uint32_t{1} << bits;
+  static constexpr uint32_t page_size = range < 256 ? range : 256;
+  static constexpr uint32_t pages_count = range / page_size;
+  static constexpr uint32_t words_count = (range + 63) / 64;
+  static constexpr uint32_t summary_count = (words_count + 63) / 64;
+
+  struct page {
+    value_type slots[page_size];
+  };
+
+  std::array<std::unique_ptr<page>, pages_count> pages;
+  std::array<uint64_t, words_count> words{};
+  std::array<uint64_t, summary_count> summary{};
+  size_t count = 0;
+
+  // Position of key in the table; signed keys are offset so that the
+  // order of positions is the order of keys.
+  static inline uint32_t index_of(const K &key) noexcept {
+    auto u = static_cast<unsigned_t>(static_cast<underlying_t>(key));
+    if constexpr (std::is_signed_v<underlying_t>)
+      u ^= unsigned_t(1) << (bits - 1);
+    return u;
+  }
+  static inline K key_at(uint32_t i) noexcept {
+    auto u = static_cast<unsigned_t>(i);
+    if constexpr (std::is_signed_v<underlying_t>)
+      u ^= unsigned_t(1) << (bits - 1);
+    return static_cast<K>(static_cast<underlying_t>(u));
+  }
+
+  inline bool occupied(uint32_t i) const noexcept {
+    return words[i / 64] >> (i % 64) & 1;
+  }
+  inline value_type &slot(uint32_t i) const noexcept {
+    return pages[i / page_size]->slots[i % page_size];
+  }
+
+  // first occupied position >= i, or range
+  inline uint32_t next_from(uint32_t i) const noexcept {
+    if (i >= range)
+      return range;
+    uint32_t w = i / 64;
+    if (uint64_t b = words[w] & (~uint64_t{0} << (i % 64)))
+      return w * 64 + std::countr_zero(b);
+    if (++w == words_count)
+      return range;
+    uint32_t s = w / 64;
+    for (uint64_t b = summary[s] & (~uint64_t{0} << (w % 64));;
+         b = summary[s]) {
+      if (b) {
+        w = s * 64 + std::countr_zero(b);
+        return w * 64 + std::countr_zero(words[w]);
+      }
+      if (++s == summary_count)
+        return range;
+    }
+  }
+
+  // last occupied position < i, or range
+  inline uint32_t prev_before(uint32_t i) const noexcept {
+    if (i == 0)
+      return range;
+    uint32_t w = --i / 64;
+    if (uint64_t b = words[w] & (~uint64_t{0} >> (63 - i % 64)))
+      return w * 64 + 63 - std::countl_zero(b);
+    if (w-- == 0)
+      return range;
+    uint32_t s = w / 64;
+    for (uint64_t b = summary[s] & (~uint64_t{0} >> (63 - w % 64));;
+         b = summary[--s]) {
+      if (b) {
+        w = s * 64 + 63 - std::countl_zero(b);
+        return w * 64 + 63 - std::countl_zero(words[w]);
+      }
+      if (s == 0)
+        return range;
+    }
+  }
+
+  inline void mark(uint32_t i) noexcept {
+    words[i / 64] |= uint64_t{1} << (i % 64);
+    summary[i / 4096] |= uint64_t{1} << (i / 64 % 64);
+  }
+  inline void unmark(uint32_t i) noexcept {
+    words[i / 64] &= ~(uint64_t{1} << (i % 64));
+    if (!words[i / 64])
+      summary[i / 4096] &= ~(uint64_t{1} << (i / 64 % 64));
+  }
+
+public:
+  class iterator {
+  private:
+    const kvfifo_direct_map *map = nullptr;
+    uint32_t i = 0;
+
+    friend class kvfifo_direct_map;
+
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = typename kvfifo_direct_map::value_type;
+    using difference_type = ptrdiff_t;
+    using pointer = value_type *;
+    using reference = value_type &;
+
+    inline iterator() noexcept = default;
+    inline iterator(const kvfifo_direct_map *map, uint32_t i) noexcept
+        : map(map), i(i) {}
+
+    inline reference operator*() const noexcept { return map->slot(i); }
+    inline pointer operator->() const noexcept { return &map->slot(i); }
+    inline iterator &operator++() noexcept {
+      i = map->next_from(i + 1);
+      return *this;
+    }
+    inline iterator operator++(int) noexcept {
+      auto prev = *this;
+      ++*this;
+      return prev;
+    }
+    inline iterator &operator--() noexcept {
+      i = map->prev_before(i);
+      return *this;
+    }
+    inline iterator operator--(int) noexcept {
+      auto prev = *this;
+      --*this;
+      return prev;
+    }
+    inline bool operator==(const iterator &other) const noexcept {
+      return i == other.i;
+    }
+  };
+  using const_iterator = iterator;
+
+  inline kvfifo_direct_map() noexcept = default;
+  kvfifo_direct_map(const kvfifo_direct_map &) = delete;
+  kvfifo_direct_map(kvfifo_direct_map &&) noexcept = default;
+
+  // Allocates the page of key if needed, the only step that may throw.
+  inline std::pair<iterator, bool> try_emplace(const K &key) {
+    uint32_t i = index_of(key);
+    if (auto &p = pages[i / page_size]; !p) {
+      p = std::make_unique<page>();
+      for (uint32_t j = 0; j < page_size; ++j)
+        p->slots[j].first = key_at(i / page_size * page_size + j);
+    }
+    if (occupied(i))
+      return {{this, i}, false};
+    mark(i);
+    ++count;
+    return {{this, i}, true};
+  }
+
+  inline T &operator[](const K &key) { return try_emplace(key).first->second; }
+
+  inline iterator find(const K &key) const noexcept {
+    uint32_t i = index_of(key);
+    return {this, occupied(i) ? i : range};
+  }
+  inline bool contains(const K &key) const noexcept {
+    return occupied(index_of(key));
+  }
+
+  inline void erase(iterator it) noexcept {
+    auto &value = slot(it.i);
+    std::destroy_at(&value.second);
+    std::construct_at(&value.second);
+    unmark(it.i);
+    --count;
+  }
+  inline void erase(const K &key) noexcept {
+    if (auto it = find(key); it.i != range)
+      erase(it);
+  }
+
+  inline void clear() noexcept {
+    for (auto it = begin(); it != end();)
+      erase(it++);
+  }
+
+  // Moves the values of keys missing here out of other, like std::map.
+  inline void merge(kvfifo_direct_map &other) {
+    for (auto it = other.begin(); it != other.end();) {
+      auto from = it++;
+      auto [to, inserted] = try_emplace(from->first);
+      if (!inserted)
+        continue;
+      std::destroy_at(&to->second);
+      std::construct_at(&to->second, std::move(from->second));
+      other.erase(from);
+    }
+  }
+
+  inline size_t size() const noexcept { return count; }
+  inline bool empty() const noexcept { return count == 0; }
+
+  inline iterator begin() const noexcept { return {this, next_from(0)}; }
+  inline iterator end() const noexcept { return {this, range}; }
+  inline iterator cbegin() const noexcept { return begin(); }
+  inline iterator cend() const noexcept { return end(); }
+
+  // Bytes of the table and of the allocated pages.
+  inline size_t memory_bytes() const noexcept {
+    size_t bytes = sizeof(*this);
+    for (const auto &p : pages)
+      bytes += p ? sizeof(page) : 0;
+    return bytes;
+  }
+};
+
+// What a bounded kvfifo does with a push when it is full.
+enum class kvfifo_overflow {
+  // throw std::length_error and leave the queue unchanged
+  reject,
+  // remove the front element
+  drop_oldest,
+  // remove the first element with the pushed key, or the front element if
+  // the key has no other elements
+  drop_oldest_same_key,
+};
+
+// Step of an edit script made by kvfifo::diff(), named after the operation
+// it replays.
+enum class kvfifo_edit : uint8_t {
+  push,
+  pop,
+  pop_key,
+  move_to_back,
+  clear,
+};
+
+// Limits of a bounded kvfifo. Storage for elements list nodes and keys map
+// nodes is reserved when the queue is built; elements == 0 means unbounded.
+// Only elements is enforced: a queue holding more than keys distinct keys
+// allocates the extra map nodes. With huge_pages, bounded or not, nodes and
+// bucket buffers are carved from 2 MiB slabs backed by transparent huge
+// pages where the kernel allows it.
+struct kvfifo_bounds {
+  size_t elements = 0;
+  size_t keys = 0;
+  kvfifo_overflow policy = kvfifo_overflow::reject;
+  bool huge_pages = false;
+};
+
+// Layout of kvfifo::dump(): one element per line, as key<TAB>value or as
+// a JSON object {"key":...,"value":...}.
+enum class kvfifo_dump_style {
+  text,
+  json,
+};
+
+struct kvfifo_dump_format {
+  kvfifo_dump_style style = kvfifo_dump_style::text;
+  // elements grouped by key, keys in order, instead of in FIFO order
+  bool by_key = false;
+  // elements written at most, 0 for all of them
+  size_t rows = 100;
+};
+
+// Writes single keys and values for kvfifo::dump(). Types with operator<<
+// are streamed; in JSON numbers and booleans stay bare, strings and other
+// streamed text are quoted and escaped, and types with no operator<< are
+// written as null, or ? in text.
+class kvfifo_dump_writer {
+private:
+  std::ostream &out;
+  kvfifo_dump_style style;
+  std::ostringstream scratch; // reused for streamed values quoted in JSON
+
+  inline void quote(std::string_view s) {
+    out << '"';
+    for (char c : s) {
+      switch (c) {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      case '\t':
+        out << "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          static constexpr char hex[] = "0123456789abcdef";
+          out << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        } else {
+          out << c;
+        }
+      }
+    }
+    out << '"';
+  }
+
+public:
+  inline kvfifo_dump_writer(std::ostream &out, kvfifo_dump_style style)
+      : out(out), style(style) {}
+
+  // Enums are written as their underlying integer, and signed and unsigned
+  // chars (int8_t, uint8_t) as numbers in both styles, as they are when used
+  // as keys. A plain char is a character, quoted in JSON.
+  template <typename T> inline void write(const T &v) {
+    constexpr bool streamable = requires { out << v; };
+    constexpr bool byte = std::is_same_v<T, signed char> ||
+                          std::is_same_v<T, unsigned char>;
+    if constexpr (std::is_enum_v<T>) {
+      write(+static_cast<std::underlying_type_t<T>>(v));
+    } else if (style == kvfifo_dump_style::text) {
+      if constexpr (byte)
+        out << +v;
+      else if constexpr (streamable)
+        out << v;
+      else
+        out << '?';
+    } else if constexpr (std::is_same_v<T, bool>) {
+      out << (v ? "true" : "false");
+    } else if constexpr (std::is_same_v<T, char>) {
+      quote(std::string_view(&v, 1));
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+      out << static_cast<long long>(v);
+    } else if constexpr (std::is_integral_v<T>) {
+      out << static_cast<unsigned long long>(v);
+    } else if constexpr (std::is_floating_point_v<T>) {
+      if (v == v && v - v == 0)
+        out << v;
+      else
+        out << "null";
+    } else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+      quote(v);
+    } else if constexpr (streamable) {
+      scratch.str({});
+      scratch << v;
+      quote(scratch.view());
+    } else {
+      out << "null";
+    }
+  }
+
+  inline std::ostream &stream() noexcept { return out; }
+};
+
+// Bytes held by the state of a kvfifo, as reported by memory_usage(). Node
+// sizes follow the libstdc++ layout and exclude allocator overhead and
+// memory owned by the keys and values themselves.
+struct kvfifo_memory_usage {
+  // nodes of the element list
+  size_t list_bytes = 0;
+  // nodes of the key index, including buckets stored inline
+  size_t map_bytes = 0;
+  // heap buffers of buckets too large to be stored inline
+  size_t bucket_bytes = 0;
+  // reserved by the arena of a bounded or huge page state, free blocks
+  // included, and the part of it mapped as huge page slabs
+  size_t arena_bytes = 0;
+  size_t slab_bytes = 0;
+  // number of kvfifo objects sharing the state
+  size_t owners = 1;
+  bool shared = false;
+  // identity of the state, equal for all objects sharing it
+  const void *state = nullptr;
+
+  inline size_t total() const noexcept {
+    return list_bytes + map_bytes + bucket_bytes;
+  }
+};
 
 template <typename K, typename V> class kvfifo {
 private:
-  using list_ptr_t = typename std::list<std::pair<K, V>>::iterator;
-  using map_t = std::map<K, std::list<list_ptr_t>>;
-  using list_t = std::list<std::pair<K, V>>;
-
-  // map of lists of pointers to values of the same key
-  std::shared_ptr<map_t> kv_map;
-  // list of pairs <Key, Value>
-  std::shared_ptr<list_t> kv_list;
+  // Elements point to their key in the index instead of holding a copy, so
+  // every distinct key is stored once. Map nodes never move, so the pointer
+  // stays valid until the last element of the key is removed. Keys that are
+  // trivially copyable and no larger than a pointer are cheaper to copy into
+  // the element than to point to.
+  static constexpr bool intern_keys =
+      !std::is_trivially_copyable_v<K> || sizeof(K) > sizeof(const K *);
+  using key_ref_t = std::conditional_t<intern_keys, const K *, K>;
+
+  // Boxed values are shared by every state holding the element. A box is
+  // marked exposed once a non-const accessor gave out a reference into it;
+  // writes through that reference must stay in this state, so an exposed
+  // box is copied instead of shared when the state is copied.
+  static constexpr bool box_values = kvfifo_shared_values<V>::value;
+
+  // Owning pointer to a boxed value with an intrusive count of owners,
+  // counted like state_ptr: unique() is one acquire load, and reading 1
+  // there means the accesses of every former owner, in any thread,
+  // happened before.
+  class box_ptr {
+  private:
+    struct box {
+      std::atomic<size_t> owners;
+      V value;
+
+      template <typename... Args>
+      inline explicit box(Args &&...args)
+          : owners(1), value(std::forward<Args>(args)...) {}
+    };
+
+    box *ptr = nullptr;
+
+  public:
+    inline box_ptr() noexcept = default;
+    inline box_ptr(const box_ptr &other) noexcept : ptr(other.ptr) {
+      if (ptr)
+        ptr->owners.fetch_add(1, std::memory_order_relaxed);
+    }
+    inline box_ptr(box_ptr &&other) noexcept
+        : ptr(std::exchange(other.ptr, nullptr)) {}
+    inline box_ptr &operator=(box_ptr other) noexcept {
+      std::swap(ptr, other.ptr);
+      return *this;
+    }
+    inline ~box_ptr() {
+      if (ptr && ptr->owners.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete ptr;
+    }
+
+    // A new box owned only by the returned pointer.
+    template <typename... Args> static inline box_ptr make(Args &&...args) {
+      box_ptr result;
+      result.ptr = new box(std::forward<Args>(args)...);
+      return result;
+    }
+
+    inline bool unique() const noexcept {
+      return ptr->owners.load(std::memory_order_acquire) == 1;
+    }
+    inline V &operator*() const noexcept { return ptr->value; }
+    inline bool operator==(const box_ptr &other) const noexcept = default;
+  };
+
+  struct box_t {
+    box_ptr ptr;
+    bool exposed = false;
+  };
+  using stored_t = std::conditional_t<box_values, box_t, V>;
+  using element_t = std::pair<key_ref_t, stored_t>;
+
+  static inline const K &key_of(const key_ref_t &ref) noexcept {
+    if constexpr (intern_keys)
+      return *ref;
+    else
+      return ref;
+  }
+  // reference to the key stored in a map node
+  static inline key_ref_t ref_to(const K &key) noexcept {
+    if constexpr (intern_keys)
+      return &key;
+    else
+      return key;
+  }
+
+  static inline const V &value_of(const stored_t &stored) noexcept {
+    if constexpr (box_values)
+      return *stored.ptr;
+    else
+      return stored;
+  }
+  // what a pushed value is stored as
+  static inline decltype(auto) store(const V &val) {
+    if constexpr (box_values)
+      return box_t{box_ptr::make(val)};
+    else
+      return val;
+  }
+  // what a copy of the state stores for stored
+  static inline decltype(auto) share(const stored_t &stored) {
+    if constexpr (box_values)
+      return stored.exposed ? box_t{box_ptr::make(*stored.ptr)}
+                            : box_t{stored.ptr};
+    else
+      return stored;
+  }
+  static inline stored_t store(V &&val) {
+    if constexpr (box_values)
+      return box_t{box_ptr::make(std::move(val))};
+    else
+      return std::move(val);
+  }
+  // The value of an unshared state for a non-const accessor, copied out of
+  // its box if another state still holds the box.
+  static inline V &expose(stored_t &stored) {
+    if constexpr (box_values) {
+      if (!stored.ptr.unique())
+        stored.ptr = box_ptr::make(std::as_const(*stored.ptr));
+      stored.exposed = true;
+      return *stored.ptr;
+    } else {
+      return stored;
+    }
+  }
+
+  using list_t = std::list<element_t, kvfifo_node_allocator<element_t>>;
+  using list_ptr_t = typename list_t::iterator;
+
+  // Pointers to the elements of one key, oldest first. A ring buffer whose
+  // first inline_size slots live inside the map node, so keys with few
+  // elements cost no allocation besides the node; larger buckets move to a
+  // heap buffer that doubles when full. push_back is amortised O(1),
+  // pop_front O(1).
+  class bucket_t {
+  private:
+    static constexpr uint32_t inline_size = 4;
+    static_assert(std::is_trivially_copyable_v<list_ptr_t> &&
+                  std::is_trivially_destructible_v<list_ptr_t>);
+
+    // inline slots while capacity == inline_size, heap buffer afterwards
+    union {
+      list_ptr_t local[inline_size];
+      list_ptr_t *heap;
+    };
+    uint32_t head = 0;
+    uint32_t count = 0;
+    uint32_t capacity = inline_size; // always a power of two
+
+    inline bool on_heap() const noexcept { return capacity > inline_size; }
+    inline list_ptr_t *slots() noexcept { return on_heap() ? heap : local; }
+    inline const list_ptr_t *slots() const noexcept {
+      return on_heap() ? heap : local;
+    }
+    inline uint32_t slot(size_t i) const noexcept {
+      return (head + i) & (capacity - 1);
+    }
+
+    // Heap buffers start with a pointer to the arena they came from, null
+    // for operator new, so that the bucket does not have to store it.
+    static inline size_t buffer_bytes(uint32_t capacity) noexcept {
+      return sizeof(kvfifo_arena *) + capacity * sizeof(list_ptr_t);
+    }
+    static inline list_ptr_t *allocate_slots(uint32_t capacity,
+                                             kvfifo_arena *arena) {
+      auto bytes = buffer_bytes(capacity);
+      auto raw = static_cast<kvfifo_arena **>(
+          arena ? arena->allocate_buffer(bytes) : ::operator new(bytes));
+      *raw = arena;
+      return reinterpret_cast<list_ptr_t *>(raw + 1);
+    }
+    static inline void deallocate_slots(list_ptr_t *slots,
+                                        uint32_t capacity) noexcept {
+      auto raw = reinterpret_cast<kvfifo_arena **>(slots) - 1;
+      if (*raw)
+        (*raw)->deallocate_buffer(raw, buffer_bytes(capacity));
+      else
+        ::operator delete(raw);
+    }
+
+  public:
+    class const_iterator {
+    private:
+      const bucket_t *bucket;
+      size_t i;
+
+    public:
+      using iterator_category = std::forward_iterator_tag;
+      using value_type = list_ptr_t;
+      using difference_type = ptrdiff_t;
+      using pointer = const list_ptr_t *;
+      using reference = const list_ptr_t &;
+
+      inline const_iterator() noexcept : bucket(nullptr), i(0) {}
+      inline const_iterator(const bucket_t *bucket, size_t i) noexcept
+          : bucket(bucket), i(i) {}
+
+      inline reference operator*() const noexcept { return (*bucket)[i]; }
+      inline pointer operator->() const noexcept { return &(*bucket)[i]; }
+      inline const_iterator &operator++() noexcept {
+        ++i;
+        return *this;
+      }
+      inline const_iterator operator++(int) noexcept {
+        auto prev = *this;
+        ++i;
+        return prev;
+      }
+      inline bool operator==(const const_iterator &other) const noexcept {
+        return i == other.i;
+      }
+    };
+
+    inline bucket_t() noexcept : local{} {}
+    inline bucket_t(const bucket_t &other) : bucket_t() {
+      for (const auto &e : other)
+        push_back(e, nullptr);
+    }
+    inline bucket_t(bucket_t &&other) noexcept
+        : head(other.head), count(other.count), capacity(other.capacity) {
+      if (on_heap())
+        heap = other.heap;
+      else
+        std::copy_n(other.local, inline_size, local);
+      other.head = other.count = 0;
+      other.capacity = inline_size;
+    }
+    bucket_t &operator=(const bucket_t &) = delete;
+    inline ~bucket_t() {
+      if (on_heap())
+        deallocate_slots(heap, capacity);
+    }
+
+    // Strong guarantee: on allocation failure the bucket is unchanged. A
+    // buffer needed to grow comes from arena, or operator new if null.
+    inline void push_back(list_ptr_t e, kvfifo_arena *arena) {
+      if (count == capacity)
+        reserve(size_t{capacity} * 2, arena);
+      slots()[slot(count++)] = e;
+    }
+
+    // Makes room for n elements, rounded up to a power of two. Throws
+    // std::length_error past the 2^31 elements a bucket can hold.
+    inline void reserve(size_t n, kvfifo_arena *arena) {
+      if (n <= capacity)
+        return;
+      if (n > (size_t{1} << 31))
+        throw std::length_error("kvfifo: too many elements for a key");
+      auto wanted = static_cast<uint32_t>(std::bit_ceil(n));
+      auto bigger = allocate_slots(wanted, arena);
+      for (uint32_t i = 0; i < count; ++i)
+        bigger[i] = (*this)[i];
+      if (on_heap())
+        deallocate_slots(heap, capacity);
+      heap = bigger;
+      head = 0;
+      capacity = wanted;
+    }
+
+    // A heap bucket drained down to inline_size elements moves back inline
+    // and returns its buffer, so buffers are held only by large buckets.
+    inline void pop_front() noexcept {
+      head = slot(1);
+      --count;
+      if (on_heap() && count == inline_size) {
+        auto buffer = heap;
+        for (uint32_t i = 0; i < count; ++i)
+          local[i] = buffer[slot(i)];
+        deallocate_slots(buffer, capacity);
+        head = 0;
+        capacity = inline_size;
+      }
+    }
+
+    inline const list_ptr_t &operator[](size_t i) const noexcept {
+      return slots()[slot(i)];
+    }
+    inline const list_ptr_t &front() const noexcept { return (*this)[0]; }
+    inline const list_ptr_t &back() const noexcept {
+      return (*this)[count - 1];
+    }
+    inline size_t size() const noexcept { return count; }
+    inline size_t heap_bytes() const noexcept {
+      return on_heap() ? buffer_bytes(capacity) : 0;
+    }
+    inline bool empty() const noexcept { return count == 0; }
+    inline const_iterator begin() const noexcept { return {this, 0}; }
+    inline const_iterator end() const noexcept { return {this, count}; }
+  };
+
+  static constexpr bool direct_index = kvfifo_direct_index<K>::value;
+  using map_alloc_t = kvfifo_node_allocator<std::pair<const K, bucket_t>>;
+  using map_t =
+      std::conditional_t<direct_index, kvfifo_direct_map<K, bucket_t>,
+                         std::map<K, bucket_t, std::less<K>, map_alloc_t>>;
+
+  // Approximate node sizes, exact for libstdc++: list nodes hold two links,
+  // map nodes a colour and three links.
+  static constexpr size_t list_node_bytes =
+      2 * sizeof(void *) + sizeof(element_t);
+  static constexpr size_t map_node_bytes =
+      4 * sizeof(void *) + sizeof(typename map_t::value_type);
+
+  // Everything shared between copies of one queue.
+  struct state {
+    kvfifo_bounds bounds;
+    // nodes of a bounded state, declared first to outlive map and list
+    std::unique_ptr<kvfifo_arena> arena;
+    // map of lists of pointers to values of the same key; every removal
+    // erases a key whose list becomes empty
+    map_t map;
+    // list of pairs <Key in map, Value>
+    list_t list;
+    // number of kvfifo objects pointing to this state
+    std::atomic<size_t> owners;
+
+    inline explicit state(size_t owners) noexcept : owners(owners) {}
+
+    // One more element and key than the bounds are reserved, since a push
+    // to a full queue appends before it evicts.
+    inline explicit state(const kvfifo_bounds &bounds)
+        : bounds(bounds),
+          arena(bounds.elements || bounds.huge_pages
+                    ? std::make_unique<kvfifo_arena>(
+                          list_node_bytes, bounds.elements + 1, map_node_bytes,
+                          bounds.keys + 1, bounds.huge_pages)
+                    : nullptr),
+          map(make_map(arena.get())),
+          list(arena ? &arena->list_nodes() : nullptr), owners(1) {}
+
+    static inline map_t make_map(kvfifo_arena *arena) {
+      if constexpr (direct_index)
+        return map_t{};
+      else
+        return map_t(map_alloc_t(arena ? &arena->map_nodes() : nullptr));
+    }
+  };
+
+  // Owning pointer to a state with an intrusive count of owners. New owners
+  // are counted with a relaxed increment and leave with an acq_rel
+  // decrement, so unique() is one acquire load: reading 1 there means every
+  // other owner is gone and its accesses to the state happened before.
+  // Empty queues point to one static state that is never unique and never
+  // counted, so constructing and moving is noexcept and allocation-free.
+  class state_ptr {
+  private:
+    state *ptr;
+
+    static inline state *empty() noexcept {
+      static state empty_state{2};
+      return &empty_state;
+    }
+
+  public:
+    inline state_ptr() noexcept : ptr(empty()) {}
+    inline state_ptr(const state_ptr &other) noexcept : ptr(other.ptr) {
+      if (ptr != empty())
+        ptr->owners.fetch_add(1, std::memory_order_relaxed);
+    }
+    inline state_ptr(state_ptr &&other) noexcept
+        : ptr(std::exchange(other.ptr, empty())) {}
+    inline state_ptr &operator=(state_ptr other) noexcept {
+      swap(other);
+      return *this;
+    }
+    inline ~state_ptr() {
+      if (ptr != empty() &&
+          ptr->owners.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        std::unique_ptr<state>{ptr};
+    }
+
+    // A new state owned only by the returned pointer.
+    static inline state_ptr make(const kvfifo_bounds &bounds = {}) {
+      state_ptr result;
+      result.ptr = std::make_unique<state>(bounds).release();
+      return result;
+    }
+
+    inline void swap(state_ptr &other) noexcept { std::swap(ptr, other.ptr); }
+    // Number of owners, 1 for the static empty state.
+    inline size_t owners() const noexcept {
+      return ptr == empty() ? 1 : ptr->owners.load(std::memory_order_relaxed);
+    }
+    inline bool unique() const noexcept {
+      return ptr->owners.load(std::memory_order_acquire) == 1;
+    }
+    inline state &operator*() const noexcept { return *ptr; }
+    inline state *operator->() const noexcept { return ptr; }
+  };
+
+  state_ptr data;
   bool must_copy;
 
-  inline void copy() {
-    if (must_copy || !kv_map.unique() || !kv_list.unique()) {
-      try {
-        kvfifo new_this{};
-        for (const auto &[key, val] : *kv_list)
-          new_this.push(key, val);
-        *this = new_this;
-      } catch (...) {
-        throw;
+  // below this size a parallel clone is not worth waking the pool
+  static constexpr size_t parallel_clone_min = 1 << 14;
+
+  // elements handled by one part of a parallel read-only operation
+  static constexpr size_t parallel_part_min = 1 << 12;
+
+  // Number of ranges a parallel read-only operation splits the elements
+  // into, 1 on a single core: there the ranges would run one after the
+  // other, each element going through the pool's type-erased job.
+  inline size_t parallel_parts(const kvfifo_pool &pool) const noexcept {
+    size_t cores = pool.cores();
+    return cores == 1 ? 1
+                      : std::clamp<size_t>(data->list.size() /
+                                               parallel_part_min,
+                                           1, cores * 4);
+  }
+
+  // Splits the elements into parallel_parts(pool) ranges and calls
+  // body(i, key, val) for every element of range i on the threads of pool.
+  // With many keys the key index is partitioned (balanced by bucket sizes,
+  // O(keys) to split), otherwise the list is cut into segments (O(n) pointer
+  // walk to split). A single range is the list in FIFO order, which needs no
+  // split. The order of calls is unspecified.
+  template <typename F>
+  inline void for_each_part(kvfifo_pool &pool, F &&body) const {
+    size_t n = data->list.size();
+    size_t parts = parallel_parts(pool);
+
+    if (parts > 1 && data->map.size() >= parts * 4) {
+      std::vector<typename map_t::const_iterator> bounds{data->map.cbegin()};
+      size_t seen = 0;
+      for (auto it = data->map.cbegin();
+           it != data->map.cend() && bounds.size() < parts; ++it) {
+        seen += it->second.size();
+        if (seen * parts >= n * bounds.size())
+          bounds.push_back(std::next(it));
+      }
+      bounds.resize(parts + 1, data->map.cend());
+
+      pool.parallel_for(parts, [&](size_t i) {
+        for (auto it = bounds[i]; it != bounds[i + 1]; ++it)
+          for (const auto &e : it->second)
+            body(i, it->first, value_of(e->second));
+      });
+    } else {
+      std::vector<typename list_t::const_iterator> bounds;
+      bounds.reserve(parts + 1);
+      auto it = data->list.cbegin();
+      bounds.push_back(it);
+      for (size_t i = 0; i + 1 < parts; ++i) {
+        std::advance(it, n / parts + (i < n % parts));
+        bounds.push_back(it);
+      }
+      bounds.push_back(data->list.cend());
+
+      pool.parallel_for(parts, [&](size_t i) {
+        for (auto e = bounds[i]; e != bounds[i + 1]; ++e)
+          body(i, key_of(e->first), value_of(e->second));
+      });
+    }
+  }
+
+  // Appends (key, stored) to st, leaving st unchanged if that throws.
+  // O(log n).
+  template <typename S>
+  static inline void append(state &st, const K &key, S &&stored) {
+    auto [it, inserted] = st.map.try_emplace(key);
+    bool do_pop_back = false;
+    try {
+      st.list.emplace_back(ref_to(it->first), std::forward<S>(stored));
+      do_pop_back = true;
+      it->second.push_back(std::prev(st.list.end()), st.arena.get());
+    } catch (...) {
+      if (do_pop_back)
+        st.list.pop_back();
+      if (inserted)
+        st.map.erase(it);
+      throw;
+    }
+  }
+
+  // Removes the front element of a non-empty unshared state. O(log n).
+  inline void remove_front() noexcept {
+    auto it = data->map.find(key_of(data->list.front().first));
+    data->list.pop_front();
+
+    auto &bucket = it->second;
+    bucket.pop_front();
+    if (bucket.empty())
+      data->map.erase(it);
+  }
+
+  // Makes room in a bounded queue after key was pushed past its capacity,
+  // according to its overflow policy. O(log n).
+  inline void evict(const K &key) noexcept {
+    auto &bucket = data->map.find(key)->second;
+    if (data->bounds.policy == kvfifo_overflow::drop_oldest_same_key &&
+        bucket.size() > 1) {
+      data->list.erase(bucket.front());
+      bucket.pop_front();
+    } else {
+      remove_front();
+    }
+  }
+
+  // Serialized form: header, then with serial_indexed the distinct keys in
+  // increasing order, each followed by its number of elements (uint64_t),
+  // then the elements in FIFO order, each made of the position of its key
+  // in that table (uint32_t) or of the key itself, followed by the value.
+  struct serial_header {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t elements;
+    uint64_t keys;
+  };
+  static constexpr uint32_t serial_magic = 0x3146564b; // "KVF1"
+  static constexpr uint32_t serial_indexed = 1;
+
+  // Inserts key, greater than every key of map, in amortised O(1).
+  static inline auto &insert_last(map_t &map, K &&key) {
+    if constexpr (direct_index)
+      return *map.try_emplace(key).first;
+    else
+      return *map.emplace_hint(map.end(), std::piecewise_construct,
+                               std::forward_as_tuple(std::move(key)),
+                               std::forward_as_tuple());
+  }
+
+  // O(n) with a key table, O(n log k) without.
+  template <typename Source> static inline kvfifo load(Source &in) {
+    serial_header header;
+    in.read(&header, sizeof(header));
+    if (header.magic != serial_magic || (header.flags & ~serial_indexed))
+      throw std::runtime_error("kvfifo: not a serialized kvfifo");
+
+    kvfifo result;
+    result.data = state_ptr::make();
+    auto &st = *result.data;
+    if (!(header.flags & serial_indexed)) {
+      for (uint64_t i = 0; i < header.elements; ++i) {
+        K key = kvfifo_codec<K>::read(in);
+        append(st, key, store(kvfifo_codec<V>::read(in)));
       }
+      return result;
+    }
+
+    // Counts come from the input: they have to add up to the header, and
+    // buckets reserve no more than a bounded head start, growing as their
+    // elements are read, so that a crafted count cannot allocate much.
+    std::vector<typename map_t::value_type *> keys;
+    std::vector<uint64_t> counts;
+    keys.reserve(std::min<uint64_t>(header.keys, uint64_t{1} << 16));
+    counts.reserve(keys.capacity());
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < header.keys; ++i) {
+      K key = kvfifo_codec<K>::read(in);
+      uint64_t count;
+      in.read(&count, sizeof(count));
+      if (!keys.empty() && !std::less<K>{}(keys.back()->first, key))
+        throw std::runtime_error("kvfifo: keys out of order");
+      if (count == 0 || count > header.elements - total ||
+          count > (uint64_t{1} << 31))
+        throw std::runtime_error("kvfifo: bad key count");
+      total += count;
+      keys.push_back(&insert_last(st.map, std::move(key)));
+      keys.back()->second.reserve(std::min<uint64_t>(count, 1024),
+                                  st.arena.get());
+      counts.push_back(count);
+    }
+    if (total != header.elements)
+      throw std::runtime_error("kvfifo: bad key count");
+    for (uint64_t i = 0; i < header.elements; ++i) {
+      uint32_t at;
+      in.read(&at, sizeof(at));
+      if (at >= keys.size())
+        throw std::runtime_error("kvfifo: bad key position");
+      auto &[key, bucket] = *keys[at];
+      if (bucket.size() == counts[at])
+        throw std::runtime_error("kvfifo: bad key count");
+      st.list.emplace_back(ref_to(key), store(kvfifo_codec<V>::read(in)));
+      bucket.push_back(std::prev(st.list.end()), st.arena.get());
+    }
+    return result;
+  }
+
+  // Makes *this the only owner of its state, O(n log n) if it is shared or
+  // references to its values were given out.
+  inline void copy() {
+    if (must_copy || !data.unique()) {
+      auto fresh = state_ptr::make(data->bounds);
+      for (const auto &[key, stored] : data->list)
+        append(*fresh, key_of(key), share(stored));
+      data.swap(fresh);
+      must_copy = false;
     }
   }
 
@@ -84,71 +1076,100 @@ public:
     inline pointer operator->() const noexcept { return &(it->first); }
   };
 
-  inline kvfifo()
-      : kv_map(std::make_shared<map_t>()), kv_list(std::make_shared<list_t>()),
-        must_copy(false) {}
-  inline kvfifo(const kvfifo &other)
-      : kv_map(other.kv_map), kv_list(other.kv_list), must_copy(other.must_copy) {
-    try {
-      if (must_copy)
-        copy();
-    } catch (...) {
-      throw;
+  inline kvfifo() noexcept : must_copy(false) {}
+
+  // Bounded queue: nodes for bounds.elements elements and bounds.keys keys
+  // are reserved here and recycled, so pushes stop allocating once every
+  // key count and bucket size has been seen. A push to a full queue is
+  // handled by bounds.policy. Copies keep the bounds. O(elements + keys).
+  inline explicit kvfifo(const kvfifo_bounds &bounds)
+      : data(state_ptr::make(bounds)), must_copy(false) {}
+
+  // Queue of the (key, value) pairs of [first, last) in order, built without
+  // the rollback of push: every pair is appended to the list and indexed in
+  // the same pass. A key equal to the previous one reuses its bucket and a
+  // key greater than every key so far goes to the end of the index; only
+  // the other keys are looked up. O(n + r log k) for r runs of equal keys,
+  // O(n) when the runs ascend. With bounds, the queue is bounded as by
+  // kvfifo(bounds) and pairs past the limit are handled by its policy;
+  // reject throws std::length_error. Bounds with huge_pages are worth it
+  // for large inputs, whose nodes are then carved from slabs instead of
+  // allocated one by one.
+  template <std::input_iterator It, std::sentinel_for<It> End>
+  inline kvfifo(It first, End last, const kvfifo_bounds &bounds = {})
+      : data(state_ptr::make(bounds)), must_copy(false) {
+    auto &st = *data;
+    typename map_t::value_type *prev = nullptr;
+    for (; first != last; ++first) {
+      auto &&pair = *first;
+      const K &key = std::get<0>(pair);
+      if (!prev || std::less<K>{}(prev->first, key) ||
+          std::less<K>{}(key, prev->first)) {
+        if constexpr (direct_index)
+          prev = &*st.map.try_emplace(key).first;
+        else if (st.map.empty() ||
+                 std::less<K>{}(st.map.rbegin()->first, key))
+          prev = &insert_last(st.map, K(key));
+        else
+          prev = &*st.map.try_emplace(key).first;
+      }
+      auto &&val = std::get<1>(std::forward<decltype(pair)>(pair));
+      st.list.emplace_back(ref_to(prev->first),
+                           store(std::forward<decltype(val)>(val)));
+      prev->second.push_back(std::prev(st.list.end()), st.arena.get());
+      if (bounds.elements && st.list.size() > bounds.elements) {
+        if (bounds.policy == kvfifo_overflow::reject)
+          throw std::length_error("kvfifo: full");
+        evict(prev->first);
+        prev = nullptr;
+      }
     }
   }
-  inline kvfifo(kvfifo &&other) : must_copy(other.must_copy) {
-    kv_map = other.kv_map;
-    kv_list = other.kv_list;
-    other.clear();
 
+  template <std::ranges::input_range R>
+  inline explicit kvfifo(R &&range, const kvfifo_bounds &bounds = {})
+      : kvfifo(std::ranges::begin(range), std::ranges::end(range), bounds) {}
+  inline kvfifo(const kvfifo &other)
+      : data(other.data), must_copy(other.must_copy) {
     try {
       if (must_copy)
         copy();
     } catch (...) {
       throw;
     }
-  };
+  }
+  inline kvfifo(kvfifo &&other) noexcept
+      : data(std::move(other.data)), must_copy(other.must_copy) {
+    other.must_copy = false;
+  }
 
-  inline kvfifo &operator=(kvfifo other) {
-    kv_map.swap(other.kv_map);
-    kv_list.swap(other.kv_list);
+  inline kvfifo &operator=(kvfifo other) noexcept {
+    data.swap(other.data);
     must_copy = other.must_copy;
-
-    try {
-      if (must_copy)
-        copy();
-    } catch (...) {
-      throw;
-    }
-
     return *this;
-  };
+  }
 
+  // On a full bounded queue the element is appended first and the victim
+  // removed afterwards, which cannot throw, so the strong guarantee holds.
   inline void push(const K &key, const V &val) {
+    const auto &bounds = data->bounds;
+    bool full = bounds.elements && data->list.size() >= bounds.elements;
+    if (full && bounds.policy == kvfifo_overflow::reject)
+      throw std::length_error("kvfifo: full");
+
     try {
       copy();
+      append(*data, key, store(val));
     } catch (...) {
       throw;
     }
 
-    bool do_pop_back = false;
-
-    try {
-      kv_list->emplace_back(key, val);
-      do_pop_back = true;
-      (*kv_map)[key].emplace_back(std::prev(kv_list->end()));
-    } catch (...) {
-      if (do_pop_back) {
-        kv_list->pop_back();
-        if (kv_map->contains(key) && (*kv_map)[key].empty())
-          kv_map->erase(key);
-      }
-      throw;
-    }
+    if (full)
+      evict(key);
   }
 
   inline void pop() {
-    if (kv_list->empty())
+    if (data->list.empty())
       throw std::invalid_argument("kvfifo: empty");
 
     try {
@@ -157,17 +1178,11 @@ public:
       throw;
     }
 
-    auto key = kv_list->front().first;
-    kv_list->pop_front();
-
-    auto &bucket = (*kv_map)[key];
-    bucket.pop_front();
-    if (bucket.empty())
-      kv_map->erase(key);
+    remove_front();
   }
 
   inline void pop(const K &key) {
-    if (!kv_map->contains(key))
+    if (!data->map.contains(key))
       throw std::invalid_argument("kvfifo: key not found");
 
     try {
@@ -176,13 +1191,16 @@ public:
       throw;
     }
 
-    auto &bucket = (*kv_map)[key];
-    kv_list->erase(bucket.front());
+    auto it = data->map.find(key);
+    auto &bucket = it->second;
+    data->list.erase(bucket.front());
     bucket.pop_front();
+    if (bucket.empty())
+      data->map.erase(it);
   }
 
   inline void move_to_back(const K &key) {
-    if (!kv_map->contains(key))
+    if (!data->map.contains(key))
       throw std::invalid_argument("kvfifo: key not found");
 
     try {
@@ -191,13 +1209,13 @@ public:
       throw;
     }
 
-    auto &bucket = (*kv_map)[key];
+    auto &bucket = data->map[key];
     for (auto it : bucket)
-      kv_list->splice(kv_list->end(), *kv_list, it);
+      data->list.splice(data->list.end(), data->list, it);
   }
 
   inline std::pair<const K &, V &> front() {
-    if (kv_list->empty())
+    if (data->list.empty())
       throw std::invalid_argument("kvfifo: empty");
 
     try {
@@ -206,20 +1224,21 @@ public:
       throw;
     }
 
-    auto &[key, val] = kv_list->front();
+    auto &[key, stored] = data->list.front();
+    auto &val = expose(stored);
     must_copy = true;
-    return {key, val};
+    return {key_of(key), val};
   }
 
   inline std::pair<const K &, const V &> front() const {
-    if (kv_list->empty())
+    if (data->list.empty())
       throw std::invalid_argument("kvfifo: empty");
 
-    auto &[key, val] = kv_list->front();
-    return {key, val};
+    auto &[key, stored] = data->list.front();
+    return {key_of(key), value_of(stored)};
   }
   inline std::pair<const K &, V &> back() {
-    if (kv_list->empty())
+    if (data->list.empty())
       throw std::invalid_argument("kvfifo: empty");
 
     try {
@@ -228,21 +1247,22 @@ public:
       throw;
     }
 
-    auto &[key, val] = kv_list->back();
+    auto &[key, stored] = data->list.back();
+    auto &val = expose(stored);
     must_copy = true;
-    return {key, val};
+    return {key_of(key), val};
   }
 
   inline std::pair<const K &, const V &> back() const {
-    if (kv_list->empty())
+    if (data->list.empty())
       throw std::invalid_argument("kvfifo: empty");
 
-    auto &[key, val] = kv_list->back();
-    return {key, val};
+    auto &[key, stored] = data->list.back();
+    return {key_of(key), value_of(stored)};
   }
 
   inline std::pair<const K &, V &> first(const K &key) {
-    if (!kv_map->contains(key))
+    if (!data->map.contains(key))
       throw std::invalid_argument("kvfifo: key not found");
 
     try {
@@ -251,23 +1271,23 @@ public:
       throw;
     }
 
-    auto &it = (*kv_map)[key].front();
-    auto &val = it->second;
+    auto &it = data->map[key].front();
+    auto &val = expose(it->second);
     must_copy = true;
-    return {key, val};
+    return {key_of(it->first), val};
   }
 
   inline std::pair<const K &, const V &> first(const K &key) const {
-    if (!kv_map->contains(key))
+    if (!data->map.contains(key))
       throw std::invalid_argument("kvfifo: key not found");
 
-    auto &it = kv_map->find(key)->second.front();
-    auto &val = it->second;
-    return {key, val};
+    auto &it = data->map.find(key)->second.front();
+    auto &val = value_of(it->second);
+    return {key_of(it->first), val};
   }
 
   inline std::pair<const K &, V &> last(const K &key) {
-    if (!kv_map->contains(key))
+    if (!data->map.contains(key))
       throw std::invalid_argument("kvfifo: key not found");
 
     try {
@@ -276,41 +1296,476 @@ public:
       throw;
     }
 
-    auto &it = (*kv_map)[key].back();
-    auto &val = it->second;
+    auto &it = data->map[key].back();
+    auto &val = expose(it->second);
     must_copy = true;
-    return {key, val};
+    return {key_of(it->first), val};
   }
 
   inline std::pair<const K &, const V &> last(const K &key) const {
-    if (!kv_map->contains(key))
+    if (!data->map.contains(key))
       throw std::invalid_argument("kvfifo: key not found");
 
-    auto &it = kv_map->find(key)->second.back();
-    auto &val = it->second;
-    return {key, val};
+    auto &it = data->map.find(key)->second.back();
+    auto &val = value_of(it->second);
+    return {key_of(it->first), val};
   }
 
-  inline size_t size() const noexcept { return kv_list->size(); }
+  inline size_t size() const noexcept { return data->list.size(); }
 
-  inline bool empty() const noexcept { return kv_list->empty(); }
+  // Maximal number of elements, 0 if the queue is unbounded.
+  inline size_t capacity() const noexcept { return data->bounds.elements; }
+
+  inline bool empty() const noexcept { return data->list.empty(); }
 
   inline size_t count(const K &key) const noexcept {
-    return kv_map->contains(key) ? kv_map->find(key)->second.size() : 0;
+    return data->map.contains(key) ? data->map.find(key)->second.size() : 0;
   };
 
   inline void clear() {
     try {
       copy();
-      kv_map->clear();
-      kv_list->clear();
+      data->map.clear();
+      data->list.clear();
     } catch (...) {
       throw;
     }
   }
 
-  inline k_iterator k_begin() const noexcept { return {kv_map->begin()}; }
-  inline k_iterator k_end() const noexcept { return {kv_map->end()}; }
+  // Builds an unshared copy of the queue on the threads of pool. Every thread
+  // copies one segment of the list and indexes it in a map of its own, the
+  // segments are then spliced together and the maps merged. Complexity
+  // O(n log n / t + n) where t is pool.cores(). The splice and merge only
+  // pay off with a core per segment, so on a single core this is the serial
+  // copy, which the parallel one trailed by 5-15% at 1M and 10M elements.
+  inline kvfifo clone(kvfifo_pool &pool) const {
+    size_t n = data->list.size();
+    size_t parts = std::min(pool.cores(), n / parallel_clone_min);
+
+    kvfifo result;
+    result.data = state_ptr::make(data->bounds);
+    // the nodes of a bounded or huge page queue come from its own arena,
+    // so its lists cannot be built apart and spliced
+    if (parts <= 1 || result.data->arena) {
+      for (const auto &[key, stored] : data->list)
+        append(*result.data, key_of(key), share(stored));
+      return result;
+    }
+
+    std::vector<typename list_t::const_iterator> bounds;
+    bounds.reserve(parts + 1);
+    auto it = data->list.cbegin();
+    for (size_t i = 0; i < parts; ++i) {
+      bounds.push_back(it);
+      std::advance(it, n / parts + (i < n % parts));
+    }
+    bounds.push_back(it);
+
+    std::vector<list_t> lists(parts);
+    std::vector<map_t> maps(parts);
+    pool.parallel_for(parts, [&](size_t i) {
+      for (auto e = bounds[i]; e != bounds[i + 1]; ++e) {
+        auto it = maps[i].try_emplace(key_of(e->first)).first;
+        lists[i].emplace_back(ref_to(it->first), share(e->second));
+        it->second.push_back(std::prev(lists[i].end()), nullptr);
+      }
+    });
+
+    // splicing keeps the iterators stored in maps valid and merging moves
+    // map nodes, so elements keep pointing to their keys; only buckets of
+    // keys seen in earlier parts are appended and their elements repointed,
+    // O(parts + keys log keys + n) in the worst case
+    for (auto &part : lists)
+      result.data->list.splice(result.data->list.end(), part);
+    for (auto &part : maps) {
+      result.data->map.merge(part);
+      for (const auto &[key, bucket] : part) {
+        auto into = result.data->map.find(key);
+        for (const auto &e : bucket) {
+          if constexpr (intern_keys)
+            e->first = &into->first;
+          into->second.push_back(e, nullptr);
+        }
+      }
+    }
+
+    return result;
+  }
+
+  // Calls f(key, val) for every element in FIFO order. The queue is only
+  // read. O(n).
+  template <typename F> inline void for_each(F f) const {
+    for (const auto &[key, stored] : data->list)
+      f(key_of(key), value_of(stored));
+  }
+
+  // Calls f(key, val) for every element on the threads of pool, in no
+  // particular order; f has to be safe to call concurrently. The queue is
+  // only read, so no locking is done. Complexity O(n / t + keys).
+  template <typename F>
+  inline void for_each_parallel(kvfifo_pool &pool, F f) const {
+    for_each_part(pool, [&](size_t, const K &key, const V &val) {
+      f(key, val);
+    });
+  }
+
+  // Combines transform(key, val) of all elements with reduce, which has to
+  // be associative and commutative, starting from init.
+  template <typename T, typename Reduce, typename Transform>
+  inline T transform_reduce(kvfifo_pool &pool, T init, Reduce reduce,
+                            Transform transform) const {
+    std::vector<std::optional<T>> partial(parallel_parts(pool));
+    for_each_part(pool, [&](size_t i, const K &key, const V &val) {
+      if (partial[i])
+        *partial[i] = reduce(std::move(*partial[i]), transform(key, val));
+      else
+        partial[i].emplace(transform(key, val));
+    });
+
+    for (auto &part : partial)
+      if (part)
+        init = reduce(std::move(init), std::move(*part));
+    return init;
+  }
+
+  // Number of elements for which pred(key, val) holds.
+  template <typename P>
+  inline size_t count_if(kvfifo_pool &pool, P pred) const {
+    return transform_reduce(
+        pool, size_t{0}, std::plus<size_t>{},
+        [&](const K &key, const V &val) -> size_t { return pred(key, val); });
+  }
+
+  // Same as the implicit detach done by modifying operations, but the copy
+  // is built with clone(pool). Does nothing if the state is not shared.
+  inline void detach(kvfifo_pool &pool) {
+    if (must_copy || !data.unique())
+      *this = clone(pool);
+  }
+
+  // Edit script turning one queue into another, made by diff().
+  struct delta {
+    struct edit {
+      kvfifo_edit op;
+      K key;                // unused by pop and clear
+      std::optional<V> val; // set for push only
+    };
+    std::vector<edit> edits;
+
+    inline bool empty() const noexcept { return edits.empty(); }
+  };
+
+  // Edits that turn base into updated when applied to it. Queues sharing
+  // their state, such as a copy not modified since, differ by nothing,
+  // found in O(1). Otherwise the elements of base that updated still holds
+  // in order are matched greedily; the others become front or keyed pops,
+  // a key whose elements all reappear together at the back becomes a move,
+  // and the rest of updated becomes pushes. Values are compared with ==,
+  // or only by box when V has none. When no such script exists, or it
+  // would be longer, the delta clears and pushes all of updated.
+  // O(n log k) for n elements of both queues.
+  static inline delta diff(const kvfifo &base, const kvfifo &updated) {
+    delta d;
+    if (&*base.data == &*updated.data)
+      return d;
+
+    const auto &from = base.data->list;
+    const auto &to = updated.data->list;
+    auto rebuild = [&] {
+      d.edits.clear();
+      if (!from.empty())
+        d.edits.push_back({kvfifo_edit::clear, K(), std::nullopt});
+      for (const auto &[key, stored] : to)
+        d.edits.push_back({kvfifo_edit::push, key_of(key), value_of(stored)});
+      return std::move(d);
+    };
+    auto same = [](const element_t &a, const element_t &b) {
+      if (key_of(a.first) < key_of(b.first) ||
+          key_of(b.first) < key_of(a.first))
+        return false;
+      if constexpr (box_values)
+        if (a.second.ptr == b.second.ptr)
+          return true;
+      if constexpr (std::equality_comparable<V>)
+        return value_of(a.second) == value_of(b.second);
+      else
+        return false;
+    };
+
+    // which elements of base updated kept, and where the rest of it starts
+    std::vector<bool> kept;
+    kept.reserve(from.size());
+    std::set<K> kept_keys;
+    auto tail = to.begin();
+    for (const auto &e : from) {
+      bool match = tail != to.end() && same(e, *tail);
+      kept.push_back(match);
+      if (match) {
+        kept_keys.insert(key_of(e.first));
+        ++tail;
+      }
+    }
+
+    // keys with nothing kept whose elements first reappear as a run
+    std::set<K> moved, seen;
+    for (auto it = tail; it != to.end(); ++it) {
+      const K &key = key_of(it->first);
+      if (!seen.insert(key).second || kept_keys.contains(key))
+        continue;
+      auto found = base.data->map.find(key);
+      if (found == base.data->map.end())
+        continue;
+      auto run = it;
+      bool move = true;
+      for (const auto &e : found->second) {
+        if (run == to.end() || !same(*e, *run)) {
+          move = false;
+          break;
+        }
+        ++run;
+      }
+      if (move)
+        moved.insert(key);
+    }
+
+    // a removed element is the front if nothing before it stays, the first
+    // of its key if nothing of its key before it stays
+    bool stays_before = false;
+    std::set<K> stays;
+    auto k = kept.begin();
+    for (const auto &e : from) {
+      const K &key = key_of(e.first);
+      if (*k++ || moved.contains(key)) {
+        stays_before = true;
+        stays.insert(key);
+      } else if (!stays_before) {
+        d.edits.push_back({kvfifo_edit::pop, K(), std::nullopt});
+      } else if (!stays.contains(key)) {
+        d.edits.push_back({kvfifo_edit::pop_key, key, std::nullopt});
+      } else {
+        return rebuild();
+      }
+      if (d.edits.size() > to.size())
+        return rebuild();
+    }
+
+    for (auto it = tail; it != to.end();) {
+      const K &key = key_of(it->first);
+      if (moved.erase(key)) {
+        d.edits.push_back({kvfifo_edit::move_to_back, key, std::nullopt});
+        std::advance(it, base.data->map.find(key)->second.size());
+      } else {
+        d.edits.push_back({kvfifo_edit::push, key, value_of(it->second)});
+        ++it;
+      }
+      if (d.edits.size() > to.size() + 1)
+        return rebuild();
+    }
+    return d;
+  }
+
+  // Replays the edits of d, which diff() made with a base equal to this
+  // queue. Throws what the edits throw, std::invalid_argument if the queue
+  // is not that base; edits done by then stay done.
+  inline void apply(const delta &d) {
+    for (const auto &e : d.edits) {
+      switch (e.op) {
+      case kvfifo_edit::push:
+        if (!e.val)
+          throw std::invalid_argument("kvfifo: push without a value");
+        push(e.key, *e.val);
+        break;
+      case kvfifo_edit::pop:
+        pop();
+        break;
+      case kvfifo_edit::pop_key:
+        pop(e.key);
+        break;
+      case kvfifo_edit::move_to_back:
+        move_to_back(e.key);
+        break;
+      case kvfifo_edit::clear:
+        clear();
+        break;
+      }
+    }
+  }
+
+  // Writes the queue to out in a binary form read back by deserialize().
+  // With with_index the distinct keys are written once, in order, and
+  // elements refer to them, which lets deserialize() rebuild the key index
+  // in O(n); without it every element carries its key. Keys and values are
+  // encoded by kvfifo_codec. O(n log k), the state is only read.
+  inline void serialize(std::ostream &out, bool with_index = true) const {
+    if (with_index && data->map.size() > UINT32_MAX)
+      throw std::length_error("kvfifo: too many keys to index");
+    kvfifo_sink sink(out);
+    serial_header header{serial_magic, with_index ? serial_indexed : 0,
+                         data->list.size(), with_index ? data->map.size() : 0};
+    sink.write(&header, sizeof(header));
+
+    if (!with_index) {
+      for (const auto &[key, stored] : data->list) {
+        kvfifo_codec<K>::write(sink, key_of(key));
+        kvfifo_codec<V>::write(sink, value_of(stored));
+      }
+      sink.flush();
+      return;
+    }
+
+    // Interned keys are found by address, the others by binary search in
+    // a contiguous copy of the key table.
+    using position_of_t =
+        std::conditional_t<intern_keys,
+                           std::unordered_map<const K *, uint32_t>,
+                           std::vector<K>>;
+    position_of_t position_of;
+    position_of.reserve(data->map.size());
+    for (const auto &[key, bucket] : data->map) {
+      kvfifo_codec<K>::write(sink, key);
+      uint64_t count = bucket.size();
+      sink.write(&count, sizeof(count));
+      if constexpr (intern_keys)
+        position_of.emplace(&key, static_cast<uint32_t>(position_of.size()));
+      else
+        position_of.push_back(key);
+    }
+    for (const auto &[key, stored] : data->list) {
+      uint32_t position;
+      if constexpr (intern_keys)
+        position = position_of.find(key)->second;
+      else
+        position = static_cast<uint32_t>(
+            std::lower_bound(position_of.begin(), position_of.end(), key,
+                             std::less<K>{}) -
+            position_of.begin());
+      sink.write(&position, sizeof(position));
+      kvfifo_codec<V>::write(sink, value_of(stored));
+    }
+    sink.flush();
+  }
+
+  // Reads a queue written by serialize(). Throws std::runtime_error if the
+  // input is truncated or malformed.
+  static inline kvfifo deserialize(std::istream &in) {
+    kvfifo_stream_source source(in);
+    return load(source);
+  }
+
+  // Same, from bytes bytes at data, such as a memory-mapped file. Keys and
+  // values are decoded straight from the buffer.
+  static inline kvfifo deserialize(const void *data, size_t bytes) {
+    kvfifo_buffer_source source(data, bytes);
+    return load(source);
+  }
+
+  // Writes up to format.rows elements to out, in FIFO order or grouped by
+  // key, followed by a line telling how many were left out. Reads the
+  // list and the index in place: the state is neither copied nor detached,
+  // even when references to its values were given out, and nothing is
+  // allocated per element. Returns the number of elements written.
+  inline size_t dump(std::ostream &out,
+                     const kvfifo_dump_format &format = {}) const {
+    kvfifo_dump_writer writer(out, format.style);
+    bool json = format.style == kvfifo_dump_style::json;
+    size_t limit = format.rows ? format.rows : data->list.size();
+    size_t written = 0;
+    auto row = [&](const K &key, const stored_t &stored) {
+      if (json) {
+        out << "{\"key\":";
+        writer.write(key);
+        out << ",\"value\":";
+        writer.write(value_of(stored));
+        out << "}\n";
+      } else {
+        writer.write(key);
+        out << '\t';
+        writer.write(value_of(stored));
+        out << '\n';
+      }
+      return ++written < limit;
+    };
+
+    if (limit > 0) {
+      if (format.by_key) {
+        for (const auto &[key, bucket] : data->map) {
+          bool more = true;
+          for (const auto &e : bucket)
+            if (!(more = row(key, e->second)))
+              break;
+          if (!more)
+            break;
+        }
+      } else {
+        for (const auto &[key, stored] : data->list)
+          if (!row(key_of(key), stored))
+            break;
+      }
+    }
+
+    if (size_t left = data->list.size() - written) {
+      if (json)
+        out << "{\"omitted\":" << left << "}\n";
+      else
+        out << "... " << left << " more\n";
+    }
+    return written;
+  }
+
+  // Memory held by the state of the queue and how many objects share it.
+  // O(keys), the state is only read.
+  inline kvfifo_memory_usage memory_usage() const noexcept {
+    kvfifo_memory_usage usage;
+    usage.list_bytes = data->list.size() * list_node_bytes;
+    if constexpr (direct_index)
+      usage.map_bytes = data->map.memory_bytes();
+    else
+      usage.map_bytes = data->map.size() * map_node_bytes;
+    for (const auto &[key, bucket] : data->map)
+      usage.bucket_bytes += bucket.heap_bytes();
+    if (data->arena) {
+      usage.arena_bytes = data->arena->reserved_bytes();
+      usage.slab_bytes = data->arena->slab_bytes();
+    }
+    usage.owners = data.owners();
+    usage.shared = usage.owners > 1;
+    usage.state = &*data;
+    return usage;
+  }
+
+  inline k_iterator k_begin() const noexcept { return {data->map.begin()}; }
+  inline k_iterator k_end() const noexcept { return {data->map.end()}; }
+};
+
+// Sums memory_usage() of many queues, counting every shared state once.
+// Feed it every queue of the process to learn how much memory they hold
+// in total and how much of it is shared.
+class kvfifo_memory_census {
+private:
+  std::unordered_set<const void *> seen;
+  size_t total = 0;
+  size_t shared = 0;
+  size_t queues = 0;
+
+public:
+  template <typename K, typename V> inline void add(const kvfifo<K, V> &q) {
+    auto usage = q.memory_usage();
+    ++queues;
+    if (!seen.insert(usage.state).second)
+      return;
+    total += usage.total();
+    if (usage.shared)
+      shared += usage.total();
+  }
+
+  // Bytes held by all distinct states.
+  inline size_t total_bytes() const noexcept { return total; }
+  // Bytes held by states with more than one owner.
+  inline size_t shared_bytes() const noexcept { return shared; }
+  // Bytes held by states owned by a single queue.
+  inline size_t unique_bytes() const noexcept { return total - shared; }
+  inline size_t states() const noexcept { return seen.size(); }
+  inline size_t queues_seen() const noexcept { return queues; }
 };
 
 #endif // KVFIFO_H
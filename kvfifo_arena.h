@@ -0,0 +1,250 @@
+#ifndef KVFIFO_ARENA_H
+#define KVFIFO_ARENA_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+// Memory of a bounded kvfifo state, or of one asking for huge pages. Nodes
+// of the element list and of the key index come from two pools of
+// fixed-size blocks reserved when the arena is built, bucket buffers from
+// pools of power-of-two blocks reserved on first use. Freed blocks go back
+// to their pool, so once every pool has seen its peak a bounded queue no
+// longer calls operator new.
+//
+// With huge_pages, pools grow by slabs of whole 2 MiB pages mapped
+// anonymously and marked for transparent huge pages, so that nodes which
+// are linked together share few TLB entries. If the kernel refuses the
+// mapping the slab comes from operator new; if it ignores the advice the
+// slab is simply backed by small pages.
+// Not thread-safe: a state is only modified by its only owner.
+class kvfifo_arena {
+public:
+  static constexpr size_t huge_page = size_t{2} << 20;
+
+  class pool {
+  private:
+    struct free_block {
+      free_block *next;
+    };
+
+    struct chunk {
+      std::byte *ptr;
+      size_t bytes;
+      bool mapped;
+    };
+
+    std::vector<chunk> chunks;
+    free_block *free = nullptr;
+    size_t block = 0;
+    size_t chunk_blocks = 0;
+    bool huge = false;
+
+    // bytes rounded up to whole huge pages, mapped at a huge page boundary,
+    // or null if mmap failed
+    static inline std::byte *map_slab(size_t bytes) noexcept {
+      size_t padded = bytes + huge_page;
+      void *p = ::mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+        return nullptr;
+      auto raw = reinterpret_cast<uintptr_t>(p);
+      auto start = (raw + huge_page - 1) & ~(huge_page - 1);
+      if (start != raw)
+        ::munmap(p, start - raw);
+      if (size_t after = raw + padded - (start + bytes))
+        ::munmap(reinterpret_cast<void *>(start + bytes), after);
+      ::madvise(reinterpret_cast<void *>(start), bytes, MADV_HUGEPAGE);
+      return reinterpret_cast<std::byte *>(start);
+    }
+
+    // Adds a chunk of chunk_blocks blocks to the free list.
+    inline void grow() {
+      chunks.reserve(chunks.size() + 1);
+      size_t bytes = block * chunk_blocks;
+      chunk c{nullptr, bytes, false};
+      if (huge) {
+        c.bytes = (bytes + huge_page - 1) & ~(huge_page - 1);
+        c.ptr = map_slab(c.bytes);
+        c.mapped = c.ptr != nullptr;
+      }
+      if (!c.ptr)
+        c.ptr = static_cast<std::byte *>(::operator new(c.bytes));
+      for (size_t i = c.bytes / block; i-- > 0;)
+        free = ::new (c.ptr + i * block) free_block{free};
+      chunks.push_back(c);
+    }
+
+    inline void release() noexcept {
+      for (const auto &c : chunks) {
+        if (c.mapped)
+          ::munmap(c.ptr, c.bytes);
+        else
+          ::operator delete(c.ptr);
+      }
+      chunks.clear();
+    }
+
+  public:
+    inline pool() noexcept = default;
+
+    // Reserves blocks blocks of at least bytes bytes each, rounded up to
+    // whole slabs if huge is set.
+    inline pool(size_t bytes, size_t blocks, bool huge = false)
+        : block((std::max(bytes, sizeof(free_block)) + alignof(max_align_t) -
+                 1) /
+                alignof(max_align_t) * alignof(max_align_t)),
+          chunk_blocks(std::max<size_t>(blocks, 1)), huge(huge) {
+      grow();
+    }
+
+    pool(const pool &) = delete;
+    inline pool(pool &&other) noexcept
+        : chunks(std::move(other.chunks)),
+          free(std::exchange(other.free, nullptr)), block(other.block),
+          chunk_blocks(other.chunk_blocks), huge(other.huge) {
+      other.chunks.clear();
+    }
+    inline pool &operator=(pool &&other) noexcept {
+      if (this != &other) {
+        release();
+        chunks = std::move(other.chunks);
+        other.chunks.clear();
+        free = std::exchange(other.free, nullptr);
+        block = other.block;
+        chunk_blocks = other.chunk_blocks;
+        huge = other.huge;
+      }
+      return *this;
+    }
+
+    inline ~pool() { release(); }
+
+    // Requests larger than the block size, and every request of a pool
+    // that was never sized, go to operator new.
+    inline void *allocate(size_t bytes) {
+      if (bytes > block)
+        return ::operator new(bytes);
+      if (!free)
+        grow();
+      return std::exchange(free, free->next);
+    }
+
+    inline void deallocate(void *p, size_t bytes) noexcept {
+      if (bytes > block)
+        return ::operator delete(p);
+      free = ::new (p) free_block{free};
+    }
+
+    inline size_t block_size() const noexcept { return block; }
+    inline size_t reserved_bytes() const noexcept {
+      size_t bytes = 0;
+      for (const auto &c : chunks)
+        bytes += c.bytes;
+      return bytes;
+    }
+    // Bytes of the chunks that were mapped as huge page slabs.
+    inline size_t slab_bytes() const noexcept {
+      size_t bytes = 0;
+      for (const auto &c : chunks)
+        bytes += c.mapped ? c.bytes : 0;
+      return bytes;
+    }
+  };
+
+private:
+  static constexpr size_t buffer_classes = 32;
+  static constexpr size_t buffer_chunk_blocks = 16;
+
+  pool list_pool;
+  pool map_pool;
+  std::array<pool, buffer_classes> buffer_pools;
+  bool huge;
+
+  static inline size_t buffer_class(size_t bytes) noexcept {
+    return std::bit_width(std::max<size_t>(bytes, 16) - 1);
+  }
+
+public:
+  // Reserves list_blocks list nodes and map_blocks map nodes of the given
+  // sizes, in huge page slabs if huge is set.
+  inline kvfifo_arena(size_t list_node, size_t list_blocks, size_t map_node,
+                      size_t map_blocks, bool huge = false)
+      : list_pool(list_node, list_blocks, huge),
+        map_pool(map_node, map_blocks, huge), huge(huge) {}
+
+  kvfifo_arena(const kvfifo_arena &) = delete;
+  kvfifo_arena &operator=(const kvfifo_arena &) = delete;
+
+  inline pool &list_nodes() noexcept { return list_pool; }
+  inline pool &map_nodes() noexcept { return map_pool; }
+
+  inline void *allocate_buffer(size_t bytes) {
+    auto &p = buffer_pools[buffer_class(bytes)];
+    if (p.block_size() == 0)
+      p = pool(size_t{1} << buffer_class(bytes), buffer_chunk_blocks, huge);
+    return p.allocate(bytes);
+  }
+
+  inline void deallocate_buffer(void *ptr, size_t bytes) noexcept {
+    buffer_pools[buffer_class(bytes)].deallocate(ptr, bytes);
+  }
+
+  inline size_t reserved_bytes() const noexcept {
+    size_t bytes = list_pool.reserved_bytes() + map_pool.reserved_bytes();
+    for (const auto &p : buffer_pools)
+      bytes += p.reserved_bytes();
+    return bytes;
+  }
+  inline size_t slab_bytes() const noexcept {
+    size_t bytes = list_pool.slab_bytes() + map_pool.slab_bytes();
+    for (const auto &p : buffer_pools)
+      bytes += p.slab_bytes();
+    return bytes;
+  }
+};
+
+// Allocator of single nodes from an arena pool, or from operator new when
+// it has no pool, which is how unbounded kvfifo states allocate.
+template <typename T> class kvfifo_node_allocator {
+private:
+  kvfifo_arena::pool *from;
+
+  template <typename U> friend class kvfifo_node_allocator;
+
+public:
+  using value_type = T;
+
+  inline kvfifo_node_allocator(kvfifo_arena::pool *from = nullptr) noexcept
+      : from(from) {}
+  template <typename U>
+  inline kvfifo_node_allocator(const kvfifo_node_allocator<U> &other) noexcept
+      : from(other.from) {}
+
+  inline T *allocate(size_t n) {
+    if (!from)
+      return std::allocator<T>{}.allocate(n);
+    return static_cast<T *>(from->allocate(n * sizeof(T)));
+  }
+
+  inline void deallocate(T *p, size_t n) noexcept {
+    if (!from)
+      return std::allocator<T>{}.deallocate(p, n);
+    from->deallocate(p, n * sizeof(T));
+  }
+
+  template <typename U>
+  inline bool operator==(const kvfifo_node_allocator<U> &other) const noexcept {
+    return from == other.from;
+  }
+};
+
+#endif // KVFIFO_ARENA_H
@@ -0,0 +1,231 @@
+#ifndef KVFIFO_ASYNC_H
+#define KVFIFO_ASYNC_H
+
+#include "kvfifo.h"
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <list>
+#include <map>
+#include <optional>
+#include <utility>
+
+// Single-threaded executor: coroutines posted to it are resumed by run() in
+// the order they were posted.
+class kvfifo_executor {
+private:
+  std::deque<std::coroutine_handle<>> ready;
+
+public:
+  inline void post(std::coroutine_handle<> handle) { ready.push_back(handle); }
+
+  // Resumes posted coroutines until none are left, returns how many ran.
+  inline size_t run() {
+    size_t resumed = 0;
+    while (!ready.empty()) {
+      auto handle = ready.front();
+      ready.pop_front();
+      handle.resume();
+      ++resumed;
+    }
+    return resumed;
+  }
+
+  inline bool idle() const noexcept { return ready.empty(); }
+};
+
+// Fire-and-forget coroutine started on the executor passed as its first
+// argument. The frame frees itself when the body returns; an exception
+// escaping the body terminates the program.
+struct kvfifo_task {
+  struct promise_type {
+    kvfifo_executor &executor;
+
+    template <typename... Args>
+    inline promise_type(kvfifo_executor &executor, Args &&...) noexcept
+        : executor(executor) {}
+
+    inline kvfifo_task get_return_object() noexcept { return {}; }
+
+    inline auto initial_suspend() noexcept {
+      struct schedule {
+        kvfifo_executor &executor;
+        inline bool await_ready() const noexcept { return false; }
+        inline void await_suspend(std::coroutine_handle<> handle) {
+          executor.post(handle);
+        }
+        inline void await_resume() const noexcept {}
+      };
+      return schedule{executor};
+    }
+
+    inline std::suspend_never final_suspend() noexcept { return {}; }
+    inline void return_void() noexcept {}
+    inline void unhandled_exception() noexcept { std::terminate(); }
+  };
+};
+
+// kvfifo whose consumers may co_await an element instead of polling empty().
+// A push that has a matching waiter hands the element straight to the
+// longest waiting one and posts it on the executor; only pushes nobody waits
+// for reach the queue. Not thread-safe: producers and consumers are expected
+// to run on the executor's thread.
+template <typename K, typename V> class kvfifo_async {
+private:
+  struct waiter {
+    std::coroutine_handle<> handle;
+    std::optional<std::pair<K, V>> result;
+    uint64_t seq;
+  };
+  using waiters_t = std::list<waiter *>;
+
+  kvfifo<K, V> queue;
+  kvfifo_executor &executor;
+  // consumers waiting for any key, and for one key, oldest first
+  waiters_t any_waiters;
+  std::map<K, waiters_t> key_waiters;
+  uint64_t next_seq = 0;
+
+  // Common part of both awaitables; the object lives in the suspended
+  // coroutine frame, so the waiter lists may point to it.
+  class awaitable_base {
+  protected:
+    kvfifo_async &owner;
+    waiter self;
+    waiters_t *list = nullptr;
+    typename waiters_t::iterator pos;
+
+    inline explicit awaitable_base(kvfifo_async &owner) : owner(owner) {}
+
+    inline void enqueue(std::coroutine_handle<> handle, waiters_t &into) {
+      self.handle = handle;
+      self.seq = owner.next_seq++;
+      pos = into.insert(into.end(), &self);
+      list = &into;
+    }
+
+  public:
+    awaitable_base(const awaitable_base &) = delete;
+    awaitable_base &operator=(const awaitable_base &) = delete;
+
+    // a coroutine destroyed while suspended stops waiting
+    inline ~awaitable_base() {
+      if (list && !self.result)
+        list->erase(pos);
+    }
+  };
+
+public:
+  class pop_awaitable : public awaitable_base {
+  private:
+    using awaitable_base::owner;
+    using awaitable_base::self;
+
+  public:
+    inline explicit pop_awaitable(kvfifo_async &owner)
+        : awaitable_base(owner) {}
+
+    inline bool await_ready() const noexcept { return !owner.queue.empty(); }
+    inline void await_suspend(std::coroutine_handle<> handle) {
+      this->enqueue(handle, owner.any_waiters);
+    }
+    inline std::pair<K, V> await_resume() {
+      if (self.result)
+        return std::move(*self.result);
+      auto [key, val] = std::as_const(owner.queue).front();
+      std::pair<K, V> result{key, val};
+      owner.queue.pop();
+      return result;
+    }
+  };
+
+  class key_pop_awaitable : public awaitable_base {
+  private:
+    using awaitable_base::owner;
+    using awaitable_base::self;
+    K key;
+
+  public:
+    inline key_pop_awaitable(kvfifo_async &owner, const K &key)
+        : awaitable_base(owner), key(key) {}
+
+    inline bool await_ready() const noexcept {
+      return owner.queue.count(key) != 0;
+    }
+    inline void await_suspend(std::coroutine_handle<> handle) {
+      this->enqueue(handle, owner.key_waiters[key]);
+    }
+    inline std::pair<K, V> await_resume() {
+      if (self.result)
+        return std::move(*self.result);
+      std::pair<K, V> result{key,
+                             std::as_const(owner.queue).first(key).second};
+      owner.queue.pop(key);
+      return result;
+    }
+  };
+
+  inline explicit kvfifo_async(kvfifo_executor &executor)
+      : executor(executor) {}
+
+  kvfifo_async(const kvfifo_async &) = delete;
+  kvfifo_async &operator=(const kvfifo_async &) = delete;
+
+  // Gives the element to the oldest coroutine waiting for it, if any,
+  // otherwise appends it to the queue. O(log n + log w) where w is the number
+  // of keys with waiting consumers.
+  inline void push(const K &key, const V &val) {
+    auto keyed = key_waiters.find(key);
+    if (keyed != key_waiters.end() && keyed->second.empty()) {
+      // every waiter of this key was destroyed while suspended
+      key_waiters.erase(keyed);
+      keyed = key_waiters.end();
+    }
+    waiters_t *from = any_waiters.empty() ? nullptr : &any_waiters;
+    if (keyed != key_waiters.end() &&
+        (!from || keyed->second.front()->seq < from->front()->seq))
+      from = &keyed->second;
+
+    if (!from) {
+      queue.push(key, val);
+      return;
+    }
+
+    waiter *w = from->front();
+    w->result.emplace(key, val);
+    try {
+      executor.post(w->handle);
+    } catch (...) {
+      w->result.reset();
+      throw;
+    }
+    from->pop_front();
+    if (from != &any_waiters && from->empty())
+      key_waiters.erase(keyed);
+  }
+
+  // Awaitable yielding the front element, suspending while the queue is
+  // empty.
+  inline pop_awaitable async_pop() { return pop_awaitable{*this}; }
+
+  // Awaitable yielding the first element with the given key, suspending
+  // while there is none.
+  inline key_pop_awaitable async_pop(const K &key) {
+    return key_pop_awaitable{*this, key};
+  }
+
+  inline const kvfifo<K, V> &elements() const noexcept { return queue; }
+  inline size_t size() const noexcept { return queue.size(); }
+  inline bool empty() const noexcept { return queue.empty(); }
+
+  // Number of suspended consumers.
+  inline size_t waiting() const noexcept {
+    size_t n = any_waiters.size();
+    for (const auto &[key, list] : key_waiters)
+      n += list.size();
+    return n;
+  }
+};
+
+#endif // KVFIFO_ASYNC_H
@@ -0,0 +1,183 @@
+#ifndef KVFIFO_CODEC_H
+#define KVFIFO_CODEC_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Buffered writer of the bytes of a serialized kvfifo.
+class kvfifo_sink {
+private:
+  std::ostream &out;
+  std::vector<char> buffer;
+
+public:
+  inline explicit kvfifo_sink(std::ostream &out) : out(out) {
+    buffer.reserve(size_t{1} << 16);
+  }
+
+  kvfifo_sink(const kvfifo_sink &) = delete;
+  kvfifo_sink &operator=(const kvfifo_sink &) = delete;
+
+  inline void write(const void *data, size_t bytes) {
+    if (buffer.size() + bytes > buffer.capacity())
+      flush();
+    if (bytes > buffer.capacity()) {
+      out.write(static_cast<const char *>(data),
+                static_cast<std::streamsize>(bytes));
+      return;
+    }
+    auto p = static_cast<const char *>(data);
+    buffer.insert(buffer.end(), p, p + bytes);
+  }
+
+  // Throws std::runtime_error if the stream failed.
+  inline void flush() {
+    out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    buffer.clear();
+    if (!out)
+      throw std::runtime_error("kvfifo: write failed");
+  }
+};
+
+// Writer appending to a byte vector, for encodings built in memory.
+struct kvfifo_vector_sink {
+  std::vector<char> &bytes;
+
+  inline void write(const void *data, size_t n) {
+    auto p = static_cast<const char *>(data);
+    bytes.insert(bytes.end(), p, p + n);
+  }
+};
+
+// Reader of a serialized kvfifo from a stream.
+class kvfifo_stream_source {
+private:
+  std::istream &in;
+
+public:
+  inline explicit kvfifo_stream_source(std::istream &in) : in(in) {}
+
+  inline void read(void *data, size_t bytes) {
+    if (!in.read(static_cast<char *>(data),
+                 static_cast<std::streamsize>(bytes)))
+      throw std::runtime_error("kvfifo: truncated input");
+  }
+};
+
+// Reader of a serialized kvfifo held in memory, for example a mapped file.
+// Nothing is copied besides the decoded keys and values.
+class kvfifo_buffer_source {
+private:
+  const std::byte *pos;
+  const std::byte *end;
+
+public:
+  inline kvfifo_buffer_source(const void *data, size_t bytes) noexcept
+      : pos(static_cast<const std::byte *>(data)), end(pos + bytes) {}
+
+  // The next bytes bytes of the buffer, which are then skipped.
+  inline const std::byte *take(size_t bytes) {
+    if (static_cast<size_t>(end - pos) < bytes)
+      throw std::runtime_error("kvfifo: truncated input");
+    auto p = pos;
+    pos += bytes;
+    return p;
+  }
+
+  inline void read(void *data, size_t bytes) {
+    std::memcpy(data, take(bytes), bytes);
+  }
+};
+
+// How kvfifo::serialize writes a T and deserialize reads it back. Trivially
+// copyable types are written as their bytes, in the byte order of the
+// machine. Specialize for other types, as done below for strings and
+// vectors.
+template <typename T> struct kvfifo_codec {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "kvfifo_codec has to be specialized for this type");
+
+  template <typename Sink> static inline void write(Sink &out, const T &v) {
+    out.write(&v, sizeof(T));
+  }
+
+  template <typename Source> static inline T read(Source &in) {
+    T v;
+    in.read(&v, sizeof(T));
+    return v;
+  }
+};
+
+// Length as a 64-bit count followed by the elements.
+template <typename C, typename Traits, typename A>
+struct kvfifo_codec<std::basic_string<C, Traits, A>> {
+  static_assert(std::is_trivially_copyable_v<C>);
+
+  using string_t = std::basic_string<C, Traits, A>;
+
+  template <typename Sink>
+  static inline void write(Sink &out, const string_t &s) {
+    uint64_t n = s.size();
+    out.write(&n, sizeof(n));
+    out.write(s.data(), n * sizeof(C));
+  }
+
+  // grown in steps, so that a corrupt length fails on reading instead of
+  // allocating it all up front
+  template <typename Source> static inline string_t read(Source &in) {
+    uint64_t n;
+    in.read(&n, sizeof(n));
+    string_t s;
+    for (uint64_t done = 0; done < n;) {
+      uint64_t step = std::min<uint64_t>(n - done, uint64_t{1} << 16);
+      s.resize(done + step);
+      in.read(s.data() + done, step * sizeof(C));
+      done += step;
+    }
+    return s;
+  }
+};
+
+template <typename T, typename A> struct kvfifo_codec<std::vector<T, A>> {
+  using vector_t = std::vector<T, A>;
+
+  template <typename Sink>
+  static inline void write(Sink &out, const vector_t &v) {
+    uint64_t n = v.size();
+    out.write(&n, sizeof(n));
+    if constexpr (std::is_trivially_copyable_v<T>)
+      out.write(v.data(), n * sizeof(T));
+    else
+      for (const auto &e : v)
+        kvfifo_codec<T>::write(out, e);
+  }
+
+  template <typename Source> static inline vector_t read(Source &in) {
+    uint64_t n;
+    in.read(&n, sizeof(n));
+    vector_t v;
+    if constexpr (std::is_trivially_copyable_v<T>) {
+      // grown in steps like strings
+      for (uint64_t done = 0; done < n;) {
+        uint64_t step = std::min<uint64_t>(n - done, uint64_t{1} << 16);
+        v.resize(done + step);
+        in.read(v.data() + done, step * sizeof(T));
+        done += step;
+      }
+    } else {
+      for (uint64_t i = 0; i < n; ++i)
+        v.push_back(kvfifo_codec<T>::read(in));
+    }
+    return v;
+  }
+};
+
+#endif // KVFIFO_CODEC_H
@@ -0,0 +1,333 @@
+#ifndef KVFIFO_COLUMNAR_H
+#define KVFIFO_COLUMNAR_H
+
+#include "kvfifo.h"
+#include "kvfifo_codec.h"
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Archival format of a kvfifo<K, V>: the elements in FIFO order, cut into
+// segments of up to segment_rows rows, each holding its keys and its values
+// as two separate columns. A column is encoded by the type it holds:
+//  - integers as varints of the zigzagged difference to the previous row,
+//    so that sequences and small ranges take a byte or two per row;
+//  - other ordered types, such as strings, as a dictionary of the distinct
+//    values of the segment followed by a varint index per row;
+//  - anything else row by row, as kvfifo_codec writes it, floating point
+//    included: the dictionary would merge NaN into its neighbours and
+//    0.0 with -0.0, which compare equivalent.
+// Every segment starts with its row count, the byte sizes of its columns
+// and its smallest and largest key, which lets count() skip segments and
+// value columns without decoding them.
+//
+//   [uint32_t magic][uint64_t rows]
+//   segment: [uint32_t rows][uint64_t key bytes][uint64_t value bytes]
+//            [min key][max key][key column][value column]
+//   column:  [uint8_t encoding][encoded rows]
+//
+// Values are stored in the byte order of the machine, like serialize().
+template <typename K, typename V> class kvfifo_columnar {
+private:
+  enum encoding : uint8_t { delta, dictionary, rows };
+
+  static constexpr uint32_t magic = 0x3143564b; // "KVC1"
+
+  template <typename T>
+  static constexpr encoding encoding_of =
+      std::is_integral_v<T> && !std::is_same_v<T, bool>
+          ? delta
+          : (std::totally_ordered<T> && !std::is_floating_point_v<T>
+                 ? dictionary
+                 : rows);
+
+  static inline void put_varint(std::vector<char> &out, uint64_t v) {
+    while (v >= 0x80) {
+      out.push_back(static_cast<char>(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+  }
+
+  static inline uint64_t get_varint(kvfifo_buffer_source &in) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      auto b = static_cast<uint8_t>(*in.take(1));
+      v |= uint64_t{b & 0x7fu} << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+    throw std::runtime_error("kvfifo: bad varint");
+  }
+
+  template <typename T>
+  static inline void put_column(std::vector<char> &out,
+                                const std::vector<const T *> &column) {
+    constexpr encoding e = encoding_of<T>;
+    out.push_back(static_cast<char>(e));
+    if constexpr (e == delta) {
+      uint64_t prev = 0;
+      for (const T *v : column) {
+        // modular difference of the values widened to 64 bits
+        auto u = static_cast<uint64_t>(static_cast<std::conditional_t<
+                                           std::is_signed_v<T>, int64_t,
+                                           uint64_t>>(*v));
+        auto d = static_cast<int64_t>(u - prev);
+        put_varint(out, (static_cast<uint64_t>(d) << 1) ^
+                            static_cast<uint64_t>(d >> 63));
+        prev = u;
+      }
+    } else if constexpr (e == dictionary) {
+      std::map<std::reference_wrapper<const T>, uint64_t, std::less<T>>
+          index;
+      std::vector<const T *> values;
+      std::vector<uint64_t> at;
+      at.reserve(column.size());
+      for (const T *v : column) {
+        auto [it, inserted] = index.try_emplace(std::cref(*v), values.size());
+        if (inserted)
+          values.push_back(v);
+        at.push_back(it->second);
+      }
+      put_varint(out, values.size());
+      kvfifo_vector_sink sink{out};
+      for (const T *v : values)
+        kvfifo_codec<T>::write(sink, *v);
+      for (uint64_t i : at)
+        put_varint(out, i);
+    } else {
+      kvfifo_vector_sink sink{out};
+      for (const T *v : column)
+        kvfifo_codec<T>::write(sink, *v);
+    }
+  }
+
+  // Calls f(row value) for each of the n rows of a column.
+  template <typename T, typename F>
+  static inline void get_column(kvfifo_buffer_source &in, size_t n, F &&f) {
+    auto e = static_cast<encoding>(*in.take(1));
+    if (e != encoding_of<T>)
+      throw std::runtime_error("kvfifo: bad column encoding");
+    if constexpr (encoding_of<T> == delta) {
+      uint64_t prev = 0;
+      for (size_t i = 0; i < n; ++i) {
+        uint64_t z = get_varint(in);
+        prev += (z >> 1) ^ (~(z & 1) + 1);
+        f(static_cast<T>(prev));
+      }
+    } else if constexpr (encoding_of<T> == dictionary) {
+      uint64_t size = get_varint(in);
+      if (size > n)
+        throw std::runtime_error("kvfifo: bad dictionary");
+      std::vector<T> values;
+      values.reserve(size);
+      for (uint64_t i = 0; i < size; ++i)
+        values.push_back(kvfifo_codec<T>::read(in));
+      for (size_t i = 0; i < n; ++i) {
+        uint64_t at = get_varint(in);
+        if (at >= size)
+          throw std::runtime_error("kvfifo: bad dictionary index");
+        f(values[at]);
+      }
+    } else {
+      for (size_t i = 0; i < n; ++i)
+        f(kvfifo_codec<T>::read(in));
+    }
+  }
+
+  // Rows of the key column equal to key, decoding dictionaries only as far
+  // as their values.
+  static inline size_t count_in(kvfifo_buffer_source &in, size_t n,
+                                const K &key) {
+    auto equal = [&](const K &k) {
+      if constexpr (std::is_floating_point_v<K>)
+        return k == key || (k != k && key != key); // NaN finds NaN
+      else
+        return !std::less<K>{}(k, key) && !std::less<K>{}(key, k);
+    };
+    if constexpr (encoding_of<K> == dictionary) {
+      if (static_cast<encoding>(*in.take(1)) != dictionary)
+        throw std::runtime_error("kvfifo: bad column encoding");
+      uint64_t size = get_varint(in);
+      uint64_t wanted = size;
+      for (uint64_t i = 0; i < size; ++i)
+        if (equal(kvfifo_codec<K>::read(in)))
+          wanted = i;
+      size_t found = 0;
+      for (size_t i = 0; i < n; ++i)
+        found += get_varint(in) == wanted;
+      return found;
+    } else {
+      size_t found = 0;
+      get_column<K>(in, n, [&](const K &k) { found += equal(k); });
+      return found;
+    }
+  }
+
+  struct segment_header {
+    uint32_t rows;
+    uint64_t key_bytes, value_bytes;
+  };
+
+  static inline void read_exactly(std::istream &in, void *p, size_t n) {
+    if (!in.read(static_cast<char *>(p), static_cast<std::streamsize>(n)))
+      throw std::runtime_error("kvfifo: truncated input");
+  }
+
+  // Reads a segment header and its key range. The column sizes are checked
+  // one by one, so that their sum can neither wrap nor overflow a seek.
+  static inline segment_header read_segment(std::istream &in, K &min, K &max) {
+    constexpr uint64_t most = std::numeric_limits<std::streamsize>::max();
+    segment_header h;
+    read_exactly(in, &h.rows, sizeof(h.rows));
+    read_exactly(in, &h.key_bytes, sizeof(h.key_bytes));
+    read_exactly(in, &h.value_bytes, sizeof(h.value_bytes));
+    if (h.key_bytes > most || h.value_bytes > most - h.key_bytes)
+      throw std::runtime_error("kvfifo: bad segment");
+    kvfifo_stream_source source(in);
+    min = kvfifo_codec<K>::read(source);
+    max = kvfifo_codec<K>::read(source);
+    return h;
+  }
+
+  static inline uint64_t read_header(std::istream &in) {
+    uint32_t m;
+    uint64_t n;
+    read_exactly(in, &m, sizeof(m));
+    if (m != magic)
+      throw std::runtime_error("kvfifo: not a columnar kvfifo");
+    read_exactly(in, &n, sizeof(n));
+    return n;
+  }
+
+  static inline void skip(std::istream &in, uint64_t n) {
+    in.ignore(static_cast<std::streamsize>(n));
+    if (static_cast<uint64_t>(in.gcount()) != n)
+      throw std::runtime_error("kvfifo: truncated input");
+  }
+
+  static inline std::vector<char> read_bytes(std::istream &in, uint64_t n) {
+    std::vector<char> bytes;
+    // grown in steps, so that a corrupt size fails on reading
+    for (uint64_t done = 0; done < n;) {
+      uint64_t step = std::min<uint64_t>(n - done, uint64_t{1} << 20);
+      bytes.resize(done + step);
+      read_exactly(in, bytes.data() + done, step);
+      done += step;
+    }
+    return bytes;
+  }
+
+public:
+  // Writes q to out. The queue is only read. O(n log d) for segments of up
+  // to d distinct values, O(n) for integer columns.
+  static inline void write(std::ostream &out, const kvfifo<K, V> &q,
+                           size_t segment_rows = size_t{1} << 16) {
+    segment_rows = std::clamp<size_t>(segment_rows, 1, UINT32_MAX);
+    kvfifo_sink sink(out);
+    uint64_t n = q.size();
+    sink.write(&magic, sizeof(magic));
+    sink.write(&n, sizeof(n));
+
+    std::vector<const K *> keys;
+    std::vector<const V *> vals;
+    std::vector<char> key_column, value_column;
+    auto flush = [&] {
+      if (keys.empty())
+        return;
+      auto [min, max] = std::minmax_element(
+          keys.begin(), keys.end(),
+          [](const K *a, const K *b) { return std::less<K>{}(*a, *b); });
+      key_column.clear();
+      value_column.clear();
+      put_column(key_column, keys);
+      put_column(value_column, vals);
+      segment_header h{static_cast<uint32_t>(keys.size()), key_column.size(),
+                       value_column.size()};
+      sink.write(&h.rows, sizeof(h.rows));
+      sink.write(&h.key_bytes, sizeof(h.key_bytes));
+      sink.write(&h.value_bytes, sizeof(h.value_bytes));
+      kvfifo_codec<K>::write(sink, **min);
+      kvfifo_codec<K>::write(sink, **max);
+      sink.write(key_column.data(), key_column.size());
+      sink.write(value_column.data(), value_column.size());
+      keys.clear();
+      vals.clear();
+    };
+    q.for_each([&](const K &key, const V &val) {
+      keys.push_back(&key);
+      vals.push_back(&val);
+      if (keys.size() == segment_rows)
+        flush();
+    });
+    flush();
+    sink.flush();
+  }
+
+  // Reads a queue written by write(), decoding segment by segment and
+  // building the queue with the range constructor. Throws
+  // std::runtime_error if the input is truncated or malformed.
+  static inline kvfifo<K, V> read(std::istream &in) {
+    uint64_t n = read_header(in);
+    std::vector<std::pair<K, V>> pairs;
+    pairs.reserve(std::min<uint64_t>(n, uint64_t{1} << 20));
+    while (pairs.size() < n) {
+      K min, max;
+      auto h = read_segment(in, min, max);
+      if (h.rows == 0 || h.rows > n - pairs.size())
+        throw std::runtime_error("kvfifo: bad segment");
+      auto bytes = read_bytes(in, h.key_bytes + h.value_bytes);
+      kvfifo_buffer_source keys(bytes.data(), h.key_bytes);
+      kvfifo_buffer_source vals(bytes.data() + h.key_bytes, h.value_bytes);
+
+      std::vector<K> segment_keys;
+      segment_keys.reserve(h.rows);
+      get_column<K>(keys, h.rows,
+                    [&](K key) { segment_keys.push_back(std::move(key)); });
+      size_t i = 0;
+      get_column<V>(vals, h.rows, [&](V val) {
+        pairs.emplace_back(std::move(segment_keys[i++]), std::move(val));
+      });
+    }
+    return kvfifo<K, V>(std::make_move_iterator(pairs.begin()),
+                        std::make_move_iterator(pairs.end()));
+  }
+
+  // Number of elements with key in a queue written by write(), found
+  // without building it: segments whose key range excludes key are
+  // skipped, value columns are never read and key dictionaries are
+  // searched before their rows.
+  static inline size_t count(std::istream &in, const K &key) {
+    uint64_t n = read_header(in);
+    size_t found = 0;
+    for (uint64_t seen = 0; seen < n;) {
+      K min, max;
+      auto h = read_segment(in, min, max);
+      if (h.rows == 0 || h.rows > n - seen)
+        throw std::runtime_error("kvfifo: bad segment");
+      seen += h.rows;
+      if (std::less<K>{}(key, min) || std::less<K>{}(max, key)) {
+        skip(in, h.key_bytes + h.value_bytes);
+        continue;
+      }
+      auto bytes = read_bytes(in, h.key_bytes);
+      kvfifo_buffer_source keys(bytes.data(), bytes.size());
+      found += count_in(keys, h.rows, key);
+      skip(in, h.value_bytes);
+    }
+    return found;
+  }
+};
+
+#endif // KVFIFO_COLUMNAR_H
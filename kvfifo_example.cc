@@ -8,8 +8,8 @@
 auto f(kvfifo<int, int> q) { return q; }
 
 int main() {
-  kwasow::kwasowMain();
   ttt::tt_main();
+  kwasow::kwasowMain();
   int keys[] = {3, 1, 2};
 
   kvfifo<int, int> kvf1 = f({});
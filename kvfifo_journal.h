@@ -0,0 +1,181 @@
+#ifndef KVFIFO_JOURNAL_H
+#define KVFIFO_JOURNAL_H
+
+#include "kvfifo.h"
+#include "kvfifo_oplog.h"
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// When a kvfifo_journaled makes its log durable.
+enum class kvfifo_fsync {
+  // never, the page cache writes the log back
+  never,
+  // after every group written to the log
+  every_commit,
+  // after a group written at least interval after the last fsync
+  interval,
+};
+
+struct kvfifo_journal_options {
+  // a group is written once it holds this many bytes, or on commit()
+  size_t group_bytes = size_t{1} << 16;
+  kvfifo_fsync fsync = kvfifo_fsync::every_commit;
+  std::chrono::milliseconds interval{10};
+};
+
+// kvfifo that appends every modification to a write-ahead log, from which
+// replay() rebuilds the queue after a crash. Operations are encoded into
+// the current group first and then applied to the queue; the record is
+// taken back if either step throws, so the queue and the log never differ.
+// Groups are written to the log when full, by commit() and by the
+// destructor, and made durable according to the fsync policy: an
+// operation is only as durable as the last group written and synced. With
+// kvfifo_fsync::interval the group written by the destructor is synced
+// only if the interval has passed, so it may be left to the page cache.
+//
+// The log is a sequence of kvfifo_oplog records. replay() stops at the
+// first incomplete or corrupt record, which is where a crash in the middle
+// of a write leaves the log.
+template <typename K, typename V> class kvfifo_journaled {
+private:
+  using oplog = kvfifo_oplog<K, V>;
+
+  kvfifo<K, V> queue;
+  kvfifo_journal_options options;
+  int fd = -1;
+  std::vector<char> group;
+  std::chrono::steady_clock::time_point synced;
+
+  [[noreturn]] static inline void fail(const char *what) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  // Encodes op into the group, then runs apply, which changes the queue.
+  template <typename F>
+  inline void log(F &&apply, kvfifo_edit op, const K *key = nullptr,
+                  const V *val = nullptr) {
+    size_t start = group.size();
+    oplog::encode(group, op, key, val);
+    try {
+      apply();
+    } catch (...) {
+      group.resize(start);
+      throw;
+    }
+    if (group.size() >= options.group_bytes)
+      commit();
+  }
+
+public:
+  // Opens the log at path, creating it if needed, and replays it: the
+  // queue starts as it was after the last durable operation. A torn record
+  // at the end of the log is cut off.
+  inline explicit kvfifo_journaled(const std::string &path,
+                                   kvfifo_journal_options options = {})
+      : options(options), synced(std::chrono::steady_clock::now()) {
+    std::vector<char> log;
+    {
+      std::ifstream in(path, std::ios::binary);
+      log.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+    }
+    size_t valid = oplog::apply_all(queue, log.data(), log.size());
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      fail("kvfifo: open");
+    if (::ftruncate(fd, static_cast<off_t>(valid)) != 0 ||
+        ::lseek(fd, 0, SEEK_END) < 0) {
+      ::close(fd);
+      fail("kvfifo: ftruncate");
+    }
+    group.reserve(options.group_bytes + 256);
+  }
+
+  kvfifo_journaled(const kvfifo_journaled &) = delete;
+  kvfifo_journaled &operator=(const kvfifo_journaled &) = delete;
+
+  // Commits the last group; errors are lost, call commit() to see them.
+  inline ~kvfifo_journaled() {
+    try {
+      commit();
+    } catch (...) {
+    }
+    ::close(fd);
+  }
+
+  // Rebuilds the queue logged at path without opening it for writing.
+  static inline kvfifo<K, V> replay(const std::string &path) {
+    std::vector<char> log;
+    std::ifstream in(path, std::ios::binary);
+    log.assign(std::istreambuf_iterator<char>(in),
+               std::istreambuf_iterator<char>());
+    kvfifo<K, V> queue;
+    oplog::apply_all(queue, log.data(), log.size());
+    return queue;
+  }
+
+  inline void push(const K &key, const V &val) {
+    log([&] { queue.push(key, val); }, kvfifo_edit::push, &key, &val);
+  }
+
+  inline void pop() {
+    log([&] { queue.pop(); }, kvfifo_edit::pop);
+  }
+
+  inline void pop(const K &key) {
+    log([&] { queue.pop(key); }, kvfifo_edit::pop_key, &key);
+  }
+
+  inline void move_to_back(const K &key) {
+    log([&] { queue.move_to_back(key); }, kvfifo_edit::move_to_back, &key);
+  }
+
+  inline void clear() {
+    log([&] { queue.clear(); }, kvfifo_edit::clear);
+  }
+
+  // Writes the current group to the log and syncs it as the policy says.
+  // Throws std::system_error if the log cannot be written; the group is
+  // then kept and written again by the next commit.
+  inline void commit() {
+    for (size_t done = 0; done < group.size();) {
+      ssize_t n = ::write(fd, group.data() + done, group.size() - done);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        group.erase(group.begin(), group.begin() + done);
+        fail("kvfifo: write");
+      }
+      done += static_cast<size_t>(n);
+    }
+    bool wrote = !group.empty();
+    group.clear();
+
+    auto now = std::chrono::steady_clock::now();
+    if (wrote && (options.fsync == kvfifo_fsync::every_commit ||
+                  (options.fsync == kvfifo_fsync::interval &&
+                   now - synced >= options.interval))) {
+      if (::fdatasync(fd) != 0)
+        fail("kvfifo: fdatasync");
+      synced = now;
+    }
+  }
+
+  inline const kvfifo<K, V> &elements() const noexcept { return queue; }
+  inline size_t size() const noexcept { return queue.size(); }
+  inline bool empty() const noexcept { return queue.empty(); }
+  inline size_t count(const K &key) const noexcept { return queue.count(key); }
+};
+
+#endif // KVFIFO_JOURNAL_H
@@ -0,0 +1,580 @@
+#ifndef KVFIFO_MAPPED_H
+#define KVFIFO_MAPPED_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File mapped read-write and shared, so that what stays in memory is up to
+// the page cache. grow() extends the file and remaps it, possibly at
+// another address.
+class kvfifo_file_region {
+private:
+  int fd = -1;
+  std::byte *base = nullptr;
+  size_t length = 0;
+
+  [[noreturn]] static inline void fail(const char *what) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+public:
+  // Opens path, creating it with min_bytes bytes if it is empty or missing.
+  inline explicit kvfifo_file_region(const std::string &path,
+                                     size_t min_bytes = size_t{1} << 20) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      fail("kvfifo: open");
+    try {
+      struct stat st;
+      if (::fstat(fd, &st) != 0)
+        fail("kvfifo: fstat");
+      length = static_cast<size_t>(st.st_size);
+      if (length == 0) {
+        if (::ftruncate(fd, static_cast<off_t>(min_bytes)) != 0)
+          fail("kvfifo: ftruncate");
+        length = min_bytes;
+      }
+      void *p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+      if (p == MAP_FAILED)
+        fail("kvfifo: mmap");
+      base = static_cast<std::byte *>(p);
+    } catch (...) {
+      ::close(fd);
+      throw;
+    }
+  }
+
+  kvfifo_file_region(const kvfifo_file_region &) = delete;
+  kvfifo_file_region &operator=(const kvfifo_file_region &) = delete;
+
+  inline ~kvfifo_file_region() {
+    ::munmap(base, length);
+    ::close(fd);
+  }
+
+  inline std::byte *data() const noexcept { return base; }
+  inline size_t size() const noexcept { return length; }
+
+  // Makes the region at least bytes long. Pointers into it are invalidated.
+  inline void grow(size_t bytes) {
+    if (bytes <= length)
+      return;
+    if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+      fail("kvfifo: ftruncate");
+    void *p = ::mremap(base, length, bytes, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+      fail("kvfifo: mremap");
+    base = static_cast<std::byte *>(p);
+    length = bytes;
+  }
+
+  // Writes dirty pages back to the file.
+  inline void sync() {
+    if (::msync(base, length, MS_SYNC) != 0)
+      fail("kvfifo: msync");
+  }
+};
+
+// kvfifo whose elements and key index live in a Region, by default a
+// memory-mapped file, so that a queue may be larger than RAM and outlives
+// the process. Records refer to each other by offsets from the start of the
+// region, which stay valid when the region moves:
+//  - elements are doubly linked in FIFO order and singly linked, oldest
+//    first, with the other elements of their key;
+//  - keys form a treap ordered by std::less<K> with parent links, each
+//    holding the first and last element of its key and their count.
+// Freed records are kept on free lists and reused. Only for trivially
+// copyable K and V, which are stored as they are in memory, so a file is
+// only readable by builds with the same types and layout.
+//
+// Operations and their complexity match kvfifo, except that move_to_back
+// is O(m) for m elements of the key and copies are not supported.
+// References returned by the accessors are invalidated by the next push.
+template <typename K, typename V, typename Region = kvfifo_file_region>
+class kvfifo_mapped {
+  static_assert(std::is_trivially_copyable_v<K> &&
+                std::is_trivially_copyable_v<V>);
+
+private:
+  using offset_t = uint64_t; // 0 is null, the header sits there
+
+  struct element {
+    offset_t prev, next; // FIFO order, next also links free records
+    offset_t key_next;   // next element of the same key
+    offset_t key;
+    V val;
+  };
+
+  struct key_node {
+    offset_t left, right, parent; // left also links free records
+    offset_t first, last;
+    uint64_t count;
+    uint64_t priority;
+    K key;
+  };
+
+  // the bytes "kvfifo1\0" at the start of the file, on little-endian machines
+  static constexpr uint64_t magic = 0x0031'6f66'6966'766b;
+  static constexpr uint32_t version = 1;
+
+  struct header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t key_bytes, value_bytes, element_bytes, key_node_bytes;
+    offset_t end; // records are carved from [sizeof(header), end)
+    uint64_t size, keys;
+    offset_t head, tail, root;
+    offset_t free_elements, free_keys;
+    uint64_t seed;
+  };
+
+  static constexpr offset_t align(offset_t n) noexcept {
+    constexpr offset_t a = std::max({alignof(header), alignof(element),
+                                     alignof(key_node)});
+    return (n + a - 1) / a * a;
+  }
+  static constexpr offset_t first_record = align(sizeof(header));
+
+  Region region;
+
+  template <typename T> inline T &at(offset_t off) const noexcept {
+    return *reinterpret_cast<T *>(region.data() + off);
+  }
+  inline header &head() const noexcept { return at<header>(0); }
+  inline element &el(offset_t off) const noexcept { return at<element>(off); }
+  inline key_node &kn(offset_t off) const noexcept {
+    return at<key_node>(off);
+  }
+
+  inline void init() noexcept {
+    header h{};
+    h.magic = magic;
+    h.version = version;
+    h.key_bytes = sizeof(K);
+    h.value_bytes = sizeof(V);
+    h.element_bytes = sizeof(element);
+    h.key_node_bytes = sizeof(key_node);
+    h.end = first_record;
+    h.seed = 0x9e3779b97f4a7c15;
+    head() = h;
+  }
+
+  inline bool valid() const noexcept {
+    const auto &h = head();
+    return h.magic == magic && h.version == version &&
+           h.key_bytes == sizeof(K) && h.value_bytes == sizeof(V) &&
+           h.element_bytes == sizeof(element) &&
+           h.key_node_bytes == sizeof(key_node) && h.end <= region.size();
+  }
+
+  // Grows the region so that the next push cannot fail. Done before a push
+  // changes anything, which gives it the strong guarantee.
+  inline void reserve_push() {
+    const auto &h = head();
+    offset_t need = h.end;
+    if (!h.free_elements)
+      need += align(sizeof(element));
+    if (!h.free_keys)
+      need += align(sizeof(key_node));
+    if (need > region.size())
+      region.grow(std::max<size_t>(need, region.size() * 2));
+  }
+
+  // The records below were reserved by reserve_push.
+  template <typename T> inline offset_t carve(offset_t &free_list) noexcept {
+    auto &h = head();
+    if (free_list) {
+      offset_t off = free_list;
+      free_list = std::is_same_v<T, element> ? el(off).next : kn(off).left;
+      return off;
+    }
+    offset_t off = h.end;
+    h.end += align(sizeof(T));
+    return off;
+  }
+
+  inline uint64_t next_priority() noexcept {
+    auto &seed = head().seed;
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+  }
+
+  inline offset_t find(const K &key) const noexcept {
+    offset_t n = head().root;
+    while (n) {
+      const auto &node = kn(n);
+      if (std::less<K>{}(key, node.key))
+        n = node.left;
+      else if (std::less<K>{}(node.key, key))
+        n = node.right;
+      else
+        return n;
+    }
+    return 0;
+  }
+
+  // Points the parent of old (or the root) to n.
+  inline void replace_child(offset_t parent, offset_t old,
+                            offset_t n) noexcept {
+    if (!parent)
+      head().root = n;
+    else if (kn(parent).left == old)
+      kn(parent).left = n;
+    else
+      kn(parent).right = n;
+  }
+
+  // Rotates x above its parent.
+  inline void rotate_up(offset_t x) noexcept {
+    auto &node = kn(x);
+    offset_t p = node.parent;
+    auto &parent = kn(p);
+    offset_t g = parent.parent;
+    if (parent.left == x) {
+      parent.left = node.right;
+      if (node.right)
+        kn(node.right).parent = p;
+      node.right = p;
+    } else {
+      parent.right = node.left;
+      if (node.left)
+        kn(node.left).parent = p;
+      node.left = p;
+    }
+    parent.parent = x;
+    node.parent = g;
+    replace_child(g, p, x);
+  }
+
+  // Key node of key, inserted if missing. O(log k) expected.
+  inline offset_t find_or_insert(const K &key) noexcept {
+    offset_t parent = 0, n = head().root;
+    bool left = false;
+    while (n) {
+      const auto &node = kn(n);
+      if (std::less<K>{}(key, node.key))
+        left = true;
+      else if (std::less<K>{}(node.key, key))
+        left = false;
+      else
+        return n;
+      parent = n;
+      n = left ? node.left : node.right;
+    }
+
+    n = carve<key_node>(head().free_keys);
+    auto &node = kn(n);
+    node = key_node{};
+    node.key = key;
+    node.parent = parent;
+    node.priority = next_priority();
+    if (!parent)
+      head().root = n;
+    else if (left)
+      kn(parent).left = n;
+    else
+      kn(parent).right = n;
+    while (node.parent && kn(node.parent).priority < node.priority)
+      rotate_up(n);
+    ++head().keys;
+    return n;
+  }
+
+  inline void erase_key(offset_t n) noexcept {
+    auto &node = kn(n);
+    // rotate the node down until it is a leaf
+    while (node.left || node.right) {
+      offset_t child =
+          !node.right || (node.left && kn(node.left).priority >
+                                           kn(node.right).priority)
+              ? node.left
+              : node.right;
+      rotate_up(child);
+    }
+    replace_child(node.parent, n, 0);
+    node.left = head().free_keys;
+    head().free_keys = n;
+    --head().keys;
+  }
+
+  inline void link_back(offset_t e) noexcept {
+    auto &h = head();
+    el(e).prev = h.tail;
+    el(e).next = 0;
+    if (h.tail)
+      el(h.tail).next = e;
+    else
+      h.head = e;
+    h.tail = e;
+  }
+
+  inline void unlink(offset_t e) noexcept {
+    auto &h = head();
+    const auto &x = el(e);
+    if (x.prev)
+      el(x.prev).next = x.next;
+    else
+      h.head = x.next;
+    if (x.next)
+      el(x.next).prev = x.prev;
+    else
+      h.tail = x.prev;
+  }
+
+  // Removes the first element of key node n, erasing n once it is empty.
+  inline void remove_first(offset_t n) noexcept {
+    auto &node = kn(n);
+    offset_t e = node.first;
+    unlink(e);
+    node.first = el(e).key_next;
+    if (!node.first)
+      node.last = 0;
+    el(e).next = head().free_elements;
+    head().free_elements = e;
+    --head().size;
+    if (--node.count == 0)
+      erase_key(n);
+  }
+
+  inline void open() {
+    if (region.size() < first_record)
+      region.grow(first_record);
+    if (head().magic == 0 && head().end == 0)
+      init();
+    else if (!valid())
+      throw std::invalid_argument("kvfifo: incompatible region");
+  }
+
+  inline offset_t checked(const K &key) const {
+    offset_t n = find(key);
+    if (!n)
+      throw std::invalid_argument("kvfifo: key not found");
+    return n;
+  }
+
+  inline void check_not_empty() const {
+    if (!head().size)
+      throw std::invalid_argument("kvfifo: empty");
+  }
+
+public:
+  class k_iterator {
+  private:
+    const kvfifo_mapped *q = nullptr;
+    offset_t n = 0;
+
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = const K;
+    using difference_type = ptrdiff_t;
+    using pointer = const K *;
+    using reference = const K &;
+
+    inline k_iterator() = default;
+    inline k_iterator(const kvfifo_mapped *q, offset_t n) : q(q), n(n) {}
+
+    inline k_iterator &operator++() noexcept {
+      if (q->kn(n).right) {
+        n = q->kn(n).right;
+        while (q->kn(n).left)
+          n = q->kn(n).left;
+        return *this;
+      }
+      offset_t p = q->kn(n).parent;
+      while (p && q->kn(p).right == n) {
+        n = p;
+        p = q->kn(p).parent;
+      }
+      n = p;
+      return *this;
+    }
+
+    inline k_iterator operator++(int) noexcept {
+      auto prev = *this;
+      ++*this;
+      return prev;
+    }
+
+    // Decrementing k_end() gives the largest key.
+    inline k_iterator &operator--() noexcept {
+      if (!n) {
+        n = q->head().root;
+        while (q->kn(n).right)
+          n = q->kn(n).right;
+        return *this;
+      }
+      if (q->kn(n).left) {
+        n = q->kn(n).left;
+        while (q->kn(n).right)
+          n = q->kn(n).right;
+        return *this;
+      }
+      offset_t p = q->kn(n).parent;
+      while (p && q->kn(p).left == n) {
+        n = p;
+        p = q->kn(p).parent;
+      }
+      n = p;
+      return *this;
+    }
+
+    inline k_iterator operator--(int) noexcept {
+      auto prev = *this;
+      --*this;
+      return prev;
+    }
+
+    inline bool operator==(const k_iterator &other) const noexcept {
+      return n == other.n;
+    }
+
+    inline reference operator*() const noexcept { return q->kn(n).key; }
+    inline pointer operator->() const noexcept { return &q->kn(n).key; }
+  };
+
+  // Opens the queue stored in the region built from args, or starts an
+  // empty one if the region is new. Throws std::invalid_argument if the
+  // region holds something else, or a queue of other types. A lockable
+  // region, which other processes may share, is locked meanwhile.
+  template <typename... Args>
+  inline explicit kvfifo_mapped(Args &&...args)
+      : region(std::forward<Args>(args)...) {
+    if constexpr (requires { region.lock(); }) {
+      std::lock_guard lock(region);
+      open();
+    } else {
+      open();
+    }
+  }
+
+  kvfifo_mapped(const kvfifo_mapped &) = delete;
+  kvfifo_mapped &operator=(const kvfifo_mapped &) = delete;
+
+  // O(log k) expected for k keys.
+  inline void push(const K &key, const V &val) {
+    reserve_push();
+    offset_t e = carve<element>(head().free_elements);
+    offset_t n = find_or_insert(key);
+    auto &x = el(e);
+    x.key_next = 0;
+    x.key = n;
+    x.val = val;
+    link_back(e);
+
+    auto &node = kn(n);
+    if (node.last)
+      el(node.last).key_next = e;
+    else
+      node.first = e;
+    node.last = e;
+    ++node.count;
+    ++head().size;
+  }
+
+  inline void pop() {
+    check_not_empty();
+    // the front element is the first of its key
+    remove_first(el(head().head).key);
+  }
+
+  inline void pop(const K &key) { remove_first(checked(key)); }
+
+  // O(m + log k) for m elements with the key.
+  inline void move_to_back(const K &key) {
+    for (offset_t e = kn(checked(key)).first; e; e = el(e).key_next) {
+      unlink(e);
+      link_back(e);
+    }
+  }
+
+  inline std::pair<const K &, V &> front() {
+    check_not_empty();
+    auto &x = el(head().head);
+    return {kn(x.key).key, x.val};
+  }
+  inline std::pair<const K &, const V &> front() const {
+    check_not_empty();
+    const auto &x = el(head().head);
+    return {kn(x.key).key, x.val};
+  }
+
+  inline std::pair<const K &, V &> back() {
+    check_not_empty();
+    auto &x = el(head().tail);
+    return {kn(x.key).key, x.val};
+  }
+  inline std::pair<const K &, const V &> back() const {
+    check_not_empty();
+    const auto &x = el(head().tail);
+    return {kn(x.key).key, x.val};
+  }
+
+  inline std::pair<const K &, V &> first(const K &key) {
+    auto &node = kn(checked(key));
+    return {node.key, el(node.first).val};
+  }
+  inline std::pair<const K &, const V &> first(const K &key) const {
+    const auto &node = kn(checked(key));
+    return {node.key, el(node.first).val};
+  }
+
+  inline std::pair<const K &, V &> last(const K &key) {
+    auto &node = kn(checked(key));
+    return {node.key, el(node.last).val};
+  }
+  inline std::pair<const K &, const V &> last(const K &key) const {
+    const auto &node = kn(checked(key));
+    return {node.key, el(node.last).val};
+  }
+
+  inline size_t size() const noexcept { return head().size; }
+  inline bool empty() const noexcept { return head().size == 0; }
+
+  inline size_t count(const K &key) const noexcept {
+    offset_t n = find(key);
+    return n ? kn(n).count : 0;
+  }
+
+  // Drops every record; the region keeps its size. O(1).
+  inline void clear() noexcept {
+    uint64_t seed = head().seed;
+    init();
+    head().seed = seed;
+  }
+
+  // Bytes of the region in use, and its size.
+  inline size_t used_bytes() const noexcept { return head().end; }
+  inline size_t region_bytes() const noexcept { return region.size(); }
+
+  inline Region &storage() noexcept { return region; }
+
+  inline k_iterator k_begin() const noexcept {
+    offset_t n = head().root;
+    while (n && kn(n).left)
+      n = kn(n).left;
+    return {this, n};
+  }
+
+  inline k_iterator k_end() const noexcept { return {this, 0}; }
+};
+
+#endif // KVFIFO_MAPPED_H
@@ -0,0 +1,108 @@
+#ifndef KVFIFO_OPLOG_H
+#define KVFIFO_OPLOG_H
+
+#include "kvfifo.h"
+#include "kvfifo_codec.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+// Records of the modifications of a kvfifo<K, V>, shared by its write-ahead
+// journal and its replication stream. A record is
+//   [uint32_t size][kvfifo_edit op][key][value][uint32_t check]
+// with the key of push, pop_key and move_to_back and the value of push
+// encoded by kvfifo_codec. size covers op, key and value, check is their
+// FNV-1a hash, so that a torn or corrupt record is recognized as such.
+template <typename K, typename V> struct kvfifo_oplog {
+  static inline uint32_t check_of(const char *p, size_t n) noexcept {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i)
+      h = (h ^ static_cast<unsigned char>(p[i])) * 16777619u;
+    return h;
+  }
+
+  // Appends a record to bytes, leaving them unchanged on failure, such as
+  // std::length_error for a record over 4 GiB. key and val are null where
+  // op does not take them.
+  static inline void encode(std::vector<char> &bytes, kvfifo_edit op,
+                            const K *key = nullptr, const V *val = nullptr) {
+    size_t start = bytes.size();
+    try {
+      kvfifo_vector_sink out{bytes};
+      uint32_t size = 0;
+      out.write(&size, sizeof(size));
+      out.write(&op, sizeof(op));
+      if (key)
+        kvfifo_codec<K>::write(out, *key);
+      if (val)
+        kvfifo_codec<V>::write(out, *val);
+      if (bytes.size() - start - sizeof(size) > UINT32_MAX)
+        throw std::length_error("kvfifo: record too large");
+      size = static_cast<uint32_t>(bytes.size() - start - sizeof(size));
+      std::memcpy(bytes.data() + start, &size, sizeof(size));
+      uint32_t check = check_of(bytes.data() + start + sizeof(size), size);
+      out.write(&check, sizeof(check));
+    } catch (...) {
+      bytes.resize(start);
+      throw;
+    }
+  }
+
+  // Bytes of the record at the start of [p, p + n), 0 if it is incomplete
+  // or corrupt.
+  static inline size_t next(const char *p, size_t n) noexcept {
+    uint32_t size, check;
+    if (n < sizeof(size))
+      return 0;
+    std::memcpy(&size, p, sizeof(size));
+    if (size == 0 || n - sizeof(size) < size_t{size} + sizeof(check))
+      return 0;
+    std::memcpy(&check, p + sizeof(size) + size, sizeof(check));
+    if (check != check_of(p + sizeof(size), size))
+      return 0;
+    return sizeof(size) + size + sizeof(check);
+  }
+
+  // Applies the record at p, of bytes found by next(), to q.
+  static inline void apply(kvfifo<K, V> &q, const char *p, size_t bytes) {
+    size_t body = bytes - 2 * sizeof(uint32_t);
+    const char *op = p + sizeof(uint32_t);
+    kvfifo_buffer_source in(op + 1, body - 1);
+    switch (static_cast<kvfifo_edit>(*op)) {
+    case kvfifo_edit::push: {
+      K key = kvfifo_codec<K>::read(in);
+      q.push(key, kvfifo_codec<V>::read(in));
+      break;
+    }
+    case kvfifo_edit::pop:
+      q.pop();
+      break;
+    case kvfifo_edit::pop_key:
+      q.pop(kvfifo_codec<K>::read(in));
+      break;
+    case kvfifo_edit::move_to_back:
+      q.move_to_back(kvfifo_codec<K>::read(in));
+      break;
+    case kvfifo_edit::clear:
+      q.clear();
+      break;
+    default:
+      throw std::runtime_error("kvfifo: bad log record");
+    }
+  }
+
+  // Applies the intact records at the start of [p, p + n) to q, returns the
+  // bytes they take.
+  static inline size_t apply_all(kvfifo<K, V> &q, const char *p, size_t n) {
+    size_t pos = 0;
+    while (size_t bytes = next(p + pos, n - pos)) {
+      apply(q, p + pos, bytes);
+      pos += bytes;
+    }
+    return pos;
+  }
+};
+
+#endif // KVFIFO_OPLOG_H
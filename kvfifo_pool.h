@@ -0,0 +1,143 @@
+#ifndef KVFIFO_POOL_H
+#define KVFIFO_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Fixed set of worker threads used by the parallel kvfifo operations.
+// The calling thread takes part in every parallel_for, so a pool of size t
+// runs t - 1 workers.
+class kvfifo_pool {
+private:
+  std::vector<std::thread> workers;
+  size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+  std::mutex batch_mutex; // one parallel_for at a time
+  std::mutex mutex;
+  std::condition_variable work_cv;
+  std::condition_variable done_cv;
+
+  // current batch, guarded by mutex
+  const std::function<void(size_t)> *job = nullptr;
+  size_t job_size = 0;
+  std::atomic<size_t> next{0};
+  size_t running = 0;
+  size_t generation = 0;
+  std::exception_ptr error;
+  bool stopping = false;
+
+  // Takes indices of the current batch until none are left.
+  inline void drain(const std::function<void(size_t)> &f, size_t n) noexcept {
+    for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;) {
+      try {
+        f(i);
+      } catch (...) {
+        std::lock_guard lock(mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  }
+
+  inline void work() noexcept {
+    size_t seen = 0;
+    std::unique_lock lock(mutex);
+    for (;;) {
+      work_cv.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+      auto f = job;
+      auto n = job_size;
+      if (n == 0)
+        continue;
+      ++running;
+      lock.unlock();
+      drain(*f, n);
+      lock.lock();
+      if (--running == 0)
+        done_cv.notify_all();
+    }
+  }
+
+public:
+  inline explicit kvfifo_pool(
+      size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+    try {
+      for (size_t i = 1; i < threads; ++i)
+        workers.emplace_back([this] { work(); });
+    } catch (...) {
+      shutdown();
+      throw;
+    }
+  }
+
+  kvfifo_pool(const kvfifo_pool &) = delete;
+  kvfifo_pool &operator=(const kvfifo_pool &) = delete;
+
+  inline ~kvfifo_pool() { shutdown(); }
+
+  // Number of threads taking part in a parallel_for, including the caller.
+  inline size_t size() const noexcept { return workers.size() + 1; }
+
+  // Threads that can run at the same time: size(), capped by the cores of
+  // the machine.
+  inline size_t cores() const noexcept { return std::min(size(), hardware); }
+
+  // Runs f(i) for every i in [0, n) and returns once all calls finished.
+  // The first exception thrown by f is rethrown here. Must not be called
+  // from inside f.
+  template <typename F> inline void parallel_for(size_t n, F &&f) {
+    if (n == 0)
+      return;
+    if (workers.empty() || n == 1) {
+      for (size_t i = 0; i < n; ++i)
+        f(i);
+      return;
+    }
+
+    const std::function<void(size_t)> fn = std::ref(f);
+    std::lock_guard batch(batch_mutex);
+    {
+      std::lock_guard lock(mutex);
+      job = &fn;
+      job_size = n;
+      next.store(0, std::memory_order_relaxed);
+      error = nullptr;
+      ++running;
+      ++generation;
+    }
+    work_cv.notify_all();
+
+    drain(fn, n);
+
+    std::unique_lock lock(mutex);
+    --running;
+    done_cv.wait(lock, [&] { return running == 0; });
+    // workers woken after the batch ended must not pick it up again
+    job_size = 0;
+    if (error)
+      std::rethrow_exception(std::exchange(error, nullptr));
+  }
+
+private:
+  inline void shutdown() noexcept {
+    {
+      std::lock_guard lock(mutex);
+      stopping = true;
+    }
+    work_cv.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+    workers.clear();
+  }
+};
+
+#endif // KVFIFO_POOL_H
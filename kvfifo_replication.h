@@ -0,0 +1,343 @@
+#ifndef KVFIFO_REPLICATION_H
+#define KVFIFO_REPLICATION_H
+
+#include "kvfifo.h"
+#include "kvfifo_oplog.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <unistd.h>
+
+struct kvfifo_replication_options {
+  // a batch is sent once it holds this many bytes, or on flush(); at most
+  // 4 GiB, the most a frame holds
+  size_t batch_bytes = size_t{1} << 16;
+  // or once its first operation is this old, checked on every operation
+  std::chrono::microseconds delay{1000};
+  // bytes of sent frames kept for followers that resume
+  size_t backlog_bytes = size_t{16} << 20;
+};
+
+// Frames of a replication stream, read and written by kvfifo_replicated
+// and kvfifo_follower:
+//   [uint32_t bytes][uint8_t kind][uint64_t seq][uint32_t count][payload]
+// An ops frame carries count kvfifo_oplog records, the first of which has
+// sequence number seq. A snapshot frame carries a serialized queue, as it
+// was after the operation numbered seq.
+struct kvfifo_frame {
+  enum kind_t : uint8_t { ops, snapshot };
+
+  static constexpr size_t header_bytes = 4 + 1 + 8 + 4;
+
+  uint32_t bytes;
+  kind_t kind;
+  uint64_t seq;
+  uint32_t count;
+
+  inline void write(char *out) const noexcept {
+    std::memcpy(out, &bytes, 4);
+    std::memcpy(out + 4, &kind, 1);
+    std::memcpy(out + 5, &seq, 8);
+    std::memcpy(out + 13, &count, 4);
+  }
+
+  static inline kvfifo_frame read(const char *in) noexcept {
+    kvfifo_frame f;
+    std::memcpy(&f.bytes, in, 4);
+    std::memcpy(&f.kind, in + 4, 1);
+    std::memcpy(&f.seq, in + 5, 8);
+    std::memcpy(&f.count, in + 13, 4);
+    return f;
+  }
+};
+
+// kvfifo whose modifications are streamed to a follower through a file
+// descriptor, typically a pipe or a local socket. Operations are numbered
+// from 1, applied to the queue and encoded into the current batch, which
+// is sent as one frame when it is full, when it is delay old, and on
+// flush(). Sent frames stay in a backlog of backlog_bytes, from which
+// attach() resends what a reconnecting follower missed; a follower too far
+// behind gets a snapshot instead.
+//
+// The descriptor is not owned and written with blocking writes, so a slow
+// follower slows the primary down. Writing to a pipe or socket the follower
+// closed raises SIGPIPE, which the program should ignore to get the
+// std::system_error instead.
+template <typename K, typename V> class kvfifo_replicated {
+private:
+  using oplog = kvfifo_oplog<K, V>;
+
+  struct frame {
+    uint64_t first, last;
+    std::vector<char> bytes;
+  };
+
+  kvfifo<K, V> queue;
+  kvfifo_replication_options options;
+  int fd;
+  uint64_t last_seq = 0;
+  std::vector<char> batch;
+  uint32_t batch_count = 0;
+  std::chrono::steady_clock::time_point batch_start;
+  std::deque<frame> backlog;
+  size_t backlog_size = 0;
+
+  inline void send(const std::vector<char> &bytes) {
+    for (size_t done = 0; done < bytes.size();) {
+      ssize_t n = ::write(fd, bytes.data() + done, bytes.size() - done);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::system_error(errno, std::generic_category(),
+                                "kvfifo: write");
+      }
+      done += static_cast<size_t>(n);
+    }
+  }
+
+  // Moves the batch into the backlog as a frame, returns it.
+  inline const frame *seal() {
+    if (!batch_count)
+      return nullptr;
+    frame f{last_seq - batch_count + 1, last_seq, {}};
+    f.bytes.resize(kvfifo_frame::header_bytes + batch.size());
+    kvfifo_frame{static_cast<uint32_t>(batch.size()), kvfifo_frame::ops,
+                 f.first, batch_count}
+        .write(f.bytes.data());
+    std::memcpy(f.bytes.data() + kvfifo_frame::header_bytes, batch.data(),
+                batch.size());
+    batch.clear();
+    batch_count = 0;
+
+    backlog_size += f.bytes.size();
+    backlog.push_back(std::move(f));
+    while (backlog.size() > 1 && backlog_size > options.backlog_bytes) {
+      backlog_size -= backlog.front().bytes.size();
+      backlog.pop_front();
+    }
+    return &backlog.back();
+  }
+
+  // Encodes op into the batch, then runs apply, which changes the queue;
+  // the record is taken back if either step throws, so that the follower
+  // never misses an operation the primary made.
+  template <typename F>
+  inline void log(F &&apply, kvfifo_edit op, const K *key = nullptr,
+                  const V *val = nullptr) {
+    auto now = std::chrono::steady_clock::now();
+    if (!batch_count)
+      batch_start = now;
+    size_t start = batch.size();
+    oplog::encode(batch, op, key, val);
+    if (batch.size() > UINT32_MAX) {
+      // the record does not fit in the frame of the batch: the batch is
+      // sent without it, and the record starts the next one if it fits
+      std::vector<char> record(batch.begin() + start, batch.end());
+      batch.resize(start);
+      if (record.size() > UINT32_MAX)
+        throw std::length_error("kvfifo: record too large for a frame");
+      flush();
+      batch = std::move(record);
+      start = 0;
+      batch_start = now;
+    }
+    try {
+      apply();
+    } catch (...) {
+      batch.resize(start);
+      throw;
+    }
+    ++last_seq;
+    ++batch_count;
+    if (batch.size() >= options.batch_bytes ||
+        now - batch_start >= options.delay)
+      flush();
+  }
+
+public:
+  // Streams to fd, which may be -1 until a follower attaches.
+  inline explicit kvfifo_replicated(int fd,
+                                    kvfifo_replication_options options = {})
+      : options(options), fd(fd) {
+    this->options.batch_bytes =
+        std::min<size_t>(options.batch_bytes, UINT32_MAX);
+    batch.reserve(std::min<size_t>(options.batch_bytes, size_t{1} << 20) +
+                  256);
+  }
+
+  kvfifo_replicated(const kvfifo_replicated &) = delete;
+  kvfifo_replicated &operator=(const kvfifo_replicated &) = delete;
+
+  // Sends the last batch; errors are lost, call flush() to see them.
+  inline ~kvfifo_replicated() {
+    try {
+      flush();
+    } catch (...) {
+    }
+  }
+
+  inline void push(const K &key, const V &val) {
+    log([&] { queue.push(key, val); }, kvfifo_edit::push, &key, &val);
+  }
+
+  inline void pop() {
+    log([&] { queue.pop(); }, kvfifo_edit::pop);
+  }
+
+  inline void pop(const K &key) {
+    log([&] { queue.pop(key); }, kvfifo_edit::pop_key, &key);
+  }
+
+  inline void move_to_back(const K &key) {
+    log([&] { queue.move_to_back(key); }, kvfifo_edit::move_to_back, &key);
+  }
+
+  inline void clear() {
+    log([&] { queue.clear(); }, kvfifo_edit::clear);
+  }
+
+  // Sends the current batch. Throws std::system_error if it cannot be
+  // written; the batch is in the backlog by then, so attach() resends it.
+  inline void flush() {
+    const frame *f = seal();
+    if (f && fd >= 0)
+      send(f->bytes);
+  }
+
+  // Streams to fd from now on, starting with what a follower that applied
+  // the operations up to applied has missed: the frames after it, or a
+  // snapshot if the backlog no longer holds them. Throws
+  // std::invalid_argument if applied is ahead of the primary, and
+  // std::length_error if the snapshot takes more than 4 GiB, which a frame
+  // cannot hold; nothing is sent then.
+  inline void attach(int fd, uint64_t applied) {
+    if (applied > last_seq)
+      throw std::invalid_argument("kvfifo: follower ahead of primary");
+    seal();
+    this->fd = fd;
+    if (applied == last_seq)
+      return;
+    if (backlog.empty() || backlog.front().first > applied + 1) {
+      std::ostringstream out;
+      queue.serialize(out);
+      std::string payload = std::move(out).str();
+      if (payload.size() > UINT32_MAX)
+        throw std::length_error("kvfifo: snapshot too large for a frame");
+      std::vector<char> bytes(kvfifo_frame::header_bytes + payload.size());
+      kvfifo_frame{static_cast<uint32_t>(payload.size()),
+                   kvfifo_frame::snapshot, last_seq, 0}
+          .write(bytes.data());
+      std::memcpy(bytes.data() + kvfifo_frame::header_bytes, payload.data(),
+                  payload.size());
+      send(bytes);
+      return;
+    }
+    for (const auto &f : backlog)
+      if (f.last > applied)
+        send(f.bytes);
+  }
+
+  // Sequence number of the last operation, 0 before the first.
+  inline uint64_t seq() const noexcept { return last_seq; }
+
+  inline const kvfifo<K, V> &elements() const noexcept { return queue; }
+  inline size_t size() const noexcept { return queue.size(); }
+  inline bool empty() const noexcept { return queue.empty(); }
+  inline size_t count(const K &key) const noexcept { return queue.count(key); }
+};
+
+// Replica of a kvfifo_replicated, fed by the frames read from a file
+// descriptor, which is not owned. Operations already applied are skipped,
+// so frames resent after a reconnection do no harm.
+template <typename K, typename V> class kvfifo_follower {
+private:
+  using oplog = kvfifo_oplog<K, V>;
+
+  kvfifo<K, V> queue;
+  int fd;
+  uint64_t last_seq = 0;
+  std::vector<char> buffer;
+
+  // Reads n bytes; false if the stream ends before the first of them when
+  // that is allowed.
+  inline bool read(char *p, size_t n, bool may_end) {
+    for (size_t done = 0; done < n;) {
+      ssize_t r = ::read(fd, p + done, n - done);
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::system_error(errno, std::generic_category(),
+                                "kvfifo: read");
+      }
+      if (r == 0) {
+        if (done == 0 && may_end)
+          return false;
+        throw std::runtime_error("kvfifo: truncated frame");
+      }
+      done += static_cast<size_t>(r);
+    }
+    return true;
+  }
+
+public:
+  inline explicit kvfifo_follower(int fd) : fd(fd) {}
+
+  // Reads from fd from now on, after a reconnection.
+  inline void attach(int fd) noexcept { this->fd = fd; }
+
+  // Reads one frame and applies it. Returns false if the stream ended.
+  // Throws std::runtime_error if operations are missing before the frame,
+  // which is then dropped, or if it is corrupt, after applying the records
+  // before the damage. applied() tells the primary where to resend from.
+  inline bool receive() {
+    char head[kvfifo_frame::header_bytes];
+    if (!read(head, sizeof(head), true))
+      return false;
+    auto f = kvfifo_frame::read(head);
+    buffer.resize(f.bytes);
+    read(buffer.data(), f.bytes, false);
+
+    if (f.kind == kvfifo_frame::snapshot) {
+      queue = kvfifo<K, V>::deserialize(buffer.data(), buffer.size());
+      last_seq = f.seq;
+      return true;
+    }
+    if (f.kind != kvfifo_frame::ops)
+      throw std::runtime_error("kvfifo: bad frame");
+    if (f.seq > last_seq + 1)
+      throw std::runtime_error("kvfifo: replication gap");
+
+    size_t pos = 0;
+    for (uint64_t s = f.seq; s < f.seq + f.count; ++s) {
+      size_t bytes = oplog::next(buffer.data() + pos, buffer.size() - pos);
+      if (!bytes)
+        throw std::runtime_error("kvfifo: bad frame");
+      if (s > last_seq) {
+        oplog::apply(queue, buffer.data() + pos, bytes);
+        last_seq = s;
+      }
+      pos += bytes;
+    }
+    return true;
+  }
+
+  // Sequence number of the last operation applied.
+  inline uint64_t applied() const noexcept { return last_seq; }
+
+  inline const kvfifo<K, V> &elements() const noexcept { return queue; }
+  inline size_t size() const noexcept { return queue.size(); }
+  inline bool empty() const noexcept { return queue.empty(); }
+  inline size_t count(const K &key) const noexcept { return queue.count(key); }
+};
+
+#endif // KVFIFO_REPLICATION_H
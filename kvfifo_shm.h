@@ -0,0 +1,178 @@
+#ifndef KVFIFO_SHM_H
+#define KVFIFO_SHM_H
+
+#include "kvfifo_mapped.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// POSIX shared memory object mapped by every process that opens it, for a
+// kvfifo_mapped shared between processes. The first cache lines hold a
+// robust process-shared mutex; the queue sees the bytes after them. Other
+// processes keep their mappings, so the region never grows: grow() throws
+// std::length_error once it is full, which makes push() throw it before
+// changing anything.
+//
+// The region is BasicLockable. Every access to the queue, including the
+// references returned by its accessors, has to be done holding the lock:
+//   std::lock_guard lock(q.storage());
+// If a process dies holding the lock, the next lock() takes it over and
+// owner_died() reports that the queue may have been left half-modified.
+class kvfifo_shm_region {
+private:
+  struct alignas(64) control {
+    std::atomic<uint32_t> ready;
+    uint32_t owner_died;
+    pthread_mutex_t mutex;
+  };
+
+  static constexpr size_t prefix = sizeof(control);
+
+  int fd = -1;
+  std::byte *base = nullptr;
+  size_t length = 0;
+
+  [[noreturn]] static inline void fail(const char *what) {
+    throw std::system_error(errno, std::generic_category(), what);
+  }
+
+  inline control &ctl() const noexcept {
+    return *reinterpret_cast<control *>(base);
+  }
+
+  inline void map() {
+    void *p =
+        ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+      fail("kvfifo: mmap");
+    base = static_cast<std::byte *>(p);
+  }
+
+  inline void init_mutex() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int r = pthread_mutex_init(&ctl().mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (r != 0)
+      throw std::system_error(r, std::generic_category(), "kvfifo: mutex");
+  }
+
+public:
+  // Opens the shared memory object name, creating it with bytes bytes if
+  // it does not exist. A process opening it while another creates it waits
+  // until the creator has set it up.
+  inline explicit kvfifo_shm_region(const std::string &name,
+                                    size_t bytes = size_t{1} << 20) {
+    bool creator = true;
+    fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+      creator = false;
+      fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0)
+      fail("kvfifo: shm_open");
+    try {
+      if (creator) {
+        length = std::max(bytes, prefix);
+        if (::ftruncate(fd, static_cast<off_t>(length)) != 0)
+          fail("kvfifo: ftruncate");
+        map();
+        init_mutex();
+        ctl().ready.store(1, std::memory_order_release);
+      } else {
+        for (;;) {
+          struct stat st;
+          if (::fstat(fd, &st) != 0)
+            fail("kvfifo: fstat");
+          if (static_cast<size_t>(st.st_size) >= prefix) {
+            length = static_cast<size_t>(st.st_size);
+            break;
+          }
+          ::sched_yield();
+        }
+        map();
+        while (!ctl().ready.load(std::memory_order_acquire))
+          ::sched_yield();
+      }
+    } catch (...) {
+      if (base)
+        ::munmap(base, length);
+      ::close(fd);
+      if (creator)
+        ::shm_unlink(name.c_str());
+      throw;
+    }
+  }
+
+  kvfifo_shm_region(const kvfifo_shm_region &) = delete;
+  kvfifo_shm_region &operator=(const kvfifo_shm_region &) = delete;
+
+  // Unmaps the region; the object lives on until remove().
+  inline ~kvfifo_shm_region() {
+    ::munmap(base, length);
+    ::close(fd);
+  }
+
+  // Removes the name; processes that have it open keep their mapping.
+  static inline void remove(const std::string &name) noexcept {
+    ::shm_unlink(name.c_str());
+  }
+
+  inline std::byte *data() const noexcept { return base + prefix; }
+  inline size_t size() const noexcept { return length - prefix; }
+
+  inline void grow(size_t bytes) {
+    if (bytes > size())
+      throw std::length_error("kvfifo: full");
+  }
+
+  inline void lock() {
+    int r = pthread_mutex_lock(&ctl().mutex);
+    if (r == EOWNERDEAD) {
+      ctl().owner_died = 1;
+      r = pthread_mutex_consistent(&ctl().mutex);
+    }
+    if (r != 0)
+      throw std::system_error(r, std::generic_category(), "kvfifo: lock");
+  }
+
+  inline bool try_lock() {
+    int r = pthread_mutex_trylock(&ctl().mutex);
+    if (r == EBUSY)
+      return false;
+    if (r == EOWNERDEAD) {
+      ctl().owner_died = 1;
+      r = pthread_mutex_consistent(&ctl().mutex);
+    }
+    if (r != 0)
+      throw std::system_error(r, std::generic_category(), "kvfifo: lock");
+    return true;
+  }
+
+  inline void unlock() noexcept { pthread_mutex_unlock(&ctl().mutex); }
+
+  // Whether a process died holding the lock since reset_owner_died(). Call
+  // holding the lock, typically to clear() the queue.
+  inline bool owner_died() const noexcept { return ctl().owner_died != 0; }
+  inline void reset_owner_died() noexcept { ctl().owner_died = 0; }
+};
+
+// kvfifo_mapped in a shared memory object, see kvfifo_shm_region.
+template <typename K, typename V>
+using kvfifo_shared = kvfifo_mapped<K, V, kvfifo_shm_region>;
+
+#endif // KVFIFO_SHM_H
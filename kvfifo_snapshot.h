@@ -0,0 +1,113 @@
+#ifndef KVFIFO_SNAPSHOT_H
+#define KVFIFO_SNAPSHOT_H
+
+#include "kvfifo.h"
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Snapshot of a kvfifo written to a file in the background. The queue is
+// frozen by forking: the child process serializes its copy of the queue
+// to path + ".tmp", syncs it and renames it over path, while the parent
+// goes on modifying the queue. The kernel copies only the pages the parent
+// writes to while the child runs, so the live queue never detaches a whole
+// state, which it would after `kvfifo copy = q;` shared with a thread.
+//
+// The child runs nothing but serialize() and kvfifo_codec, so neither may
+// wait on a lock held by another thread of the parent. Queues in huge page
+// slabs copy 2 MiB per first write to a slab while a snapshot runs.
+class kvfifo_snapshot {
+private:
+  pid_t child = -1;
+  int status = 0;
+
+  inline bool reap(int options) {
+    if (child < 0)
+      return true;
+    pid_t r;
+    while ((r = ::waitpid(child, &status, options)) < 0 && errno == EINTR) {
+    }
+    if (r == 0)
+      return false;
+    if (r < 0)
+      status = -1;
+    child = -1;
+    return true;
+  }
+
+  template <typename K, typename V>
+  [[noreturn]] static inline void write(const kvfifo<K, V> &q,
+                                        const std::string &path,
+                                        bool with_index) noexcept {
+    int code = 1;
+    try {
+      std::string tmp = path + ".tmp";
+      {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        q.serialize(out, with_index);
+        out.close();
+        if (!out)
+          ::_exit(code);
+      }
+      int fd = ::open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd >= 0 && ::fsync(fd) == 0 &&
+          std::rename(tmp.c_str(), path.c_str()) == 0)
+        code = 0;
+    } catch (...) {
+    }
+    ::_exit(code);
+  }
+
+public:
+  inline kvfifo_snapshot() noexcept = default;
+
+  // Starts writing q to path. Throws std::system_error if fork fails.
+  template <typename K, typename V>
+  inline kvfifo_snapshot(const kvfifo<K, V> &q, const std::string &path,
+                         bool with_index = true) {
+    child = ::fork();
+    if (child < 0)
+      throw std::system_error(errno, std::generic_category(), "kvfifo: fork");
+    if (child == 0)
+      write(q, path, with_index);
+  }
+
+  kvfifo_snapshot(const kvfifo_snapshot &) = delete;
+  kvfifo_snapshot &operator=(const kvfifo_snapshot &) = delete;
+
+  inline kvfifo_snapshot(kvfifo_snapshot &&other) noexcept
+      : child(std::exchange(other.child, -1)), status(other.status) {}
+  inline kvfifo_snapshot &operator=(kvfifo_snapshot &&other) noexcept {
+    if (this != &other) {
+      reap(0);
+      child = std::exchange(other.child, -1);
+      status = other.status;
+    }
+    return *this;
+  }
+
+  // Waits for the child; its errors are lost, call wait() to see them.
+  inline ~kvfifo_snapshot() { reap(0); }
+
+  // Whether the snapshot is no longer being written, without blocking.
+  inline bool ready() { return reap(WNOHANG); }
+
+  // Waits until the snapshot is written. Throws std::runtime_error if it
+  // could not be.
+  inline void wait() {
+    reap(0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      throw std::runtime_error("kvfifo: snapshot failed");
+  }
+};
+
+#endif // KVFIFO_SNAPSHOT_H
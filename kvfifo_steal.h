@@ -0,0 +1,183 @@
+#ifndef KVFIFO_STEAL_H
+#define KVFIFO_STEAL_H
+
+#include "kvfifo.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Thread pool in which every worker owns a kvfifo of tasks keyed by affinity
+// key A. A task is queued on the worker chosen by hashing its key, the owner
+// runs its tasks from the front, and an idle worker steals from the back of
+// another worker's queue: it takes every task with the key of the last
+// element, so tasks sharing a key stay on one thread.
+template <typename A, typename Hash = std::hash<A>>
+class kvfifo_stealing_pool {
+private:
+  using task_t = std::function<void()>;
+
+  struct worker {
+    std::mutex mutex;
+    kvfifo<A, task_t> tasks;
+  };
+
+  std::vector<std::unique_ptr<worker>> workers;
+  std::vector<std::thread> threads;
+  Hash hash;
+
+  // tasks sitting in some queue, and tasks not finished yet
+  std::atomic<size_t> queued{0};
+  std::atomic<size_t> unfinished{0};
+  std::atomic<size_t> sleeping{0};
+  std::mutex idle_mutex;
+  std::condition_variable idle_cv;
+  std::condition_variable done_cv;
+  std::exception_ptr error;
+  bool stopping = false;
+
+  // Front task of worker self, O(log n). Only const accessors of the kvfifo
+  // are used, so taking a task never forces a copy of the queue.
+  inline std::optional<task_t> take(worker &self) {
+    std::lock_guard lock(self.mutex);
+    if (self.tasks.empty())
+      return std::nullopt;
+    std::optional<task_t> task{std::as_const(self.tasks).front().second};
+    self.tasks.pop();
+    queued.fetch_sub(1);
+    return task;
+  }
+
+  // Moves the bucket of the last task of some other worker to self and
+  // returns its first task. O(m log n) for a bucket of m tasks.
+  inline std::optional<task_t> steal(size_t self) {
+    for (size_t i = 1; i < workers.size(); ++i) {
+      auto &victim = *workers[(self + i) % workers.size()];
+      std::vector<task_t> stolen;
+      A key;
+      {
+        std::lock_guard lock(victim.mutex);
+        if (victim.tasks.empty())
+          continue;
+        const auto &tasks = victim.tasks;
+        key = tasks.back().first;
+        stolen.reserve(tasks.count(key));
+        for (size_t m = tasks.count(key); m > 0; --m) {
+          stolen.push_back(tasks.first(key).second);
+          victim.tasks.pop(key);
+        }
+      }
+
+      // the first stolen task runs right away, the rest queue behind it
+      queued.fetch_sub(1);
+      std::lock_guard lock(workers[self]->mutex);
+      for (size_t j = 1; j < stolen.size(); ++j)
+        workers[self]->tasks.push(key, stolen[j]);
+      return std::move(stolen.front());
+    }
+    return std::nullopt;
+  }
+
+  inline void run(task_t &task) noexcept {
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard lock(idle_mutex);
+      if (!error)
+        error = std::current_exception();
+    }
+    if (unfinished.fetch_sub(1) == 1) {
+      std::lock_guard lock(idle_mutex);
+      done_cv.notify_all();
+    }
+  }
+
+  inline void work(size_t self) noexcept {
+    for (;;) {
+      if (auto task = take(*workers[self]); task || (task = steal(self))) {
+        run(*task);
+        continue;
+      }
+
+      std::unique_lock lock(idle_mutex);
+      sleeping.fetch_add(1);
+      idle_cv.wait(lock, [&] { return stopping || queued.load() > 0; });
+      sleeping.fetch_sub(1);
+      if (stopping && queued.load() == 0)
+        return;
+    }
+  }
+
+public:
+  inline explicit kvfifo_stealing_pool(
+      size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+    for (size_t i = 0; i < threads; ++i)
+      workers.push_back(std::make_unique<worker>());
+    try {
+      for (size_t i = 0; i < threads; ++i)
+        this->threads.emplace_back([this, i] { work(i); });
+    } catch (...) {
+      shutdown();
+      throw;
+    }
+  }
+
+  kvfifo_stealing_pool(const kvfifo_stealing_pool &) = delete;
+  kvfifo_stealing_pool &operator=(const kvfifo_stealing_pool &) = delete;
+
+  // Runs every queued task before returning.
+  inline ~kvfifo_stealing_pool() { shutdown(); }
+
+  // Queues task on the worker owning key. O(log n).
+  inline void submit(const A &key, task_t task) {
+    auto &owner = *workers[hash(key) % workers.size()];
+    // counted first so that a worker finishing the task never sees zero
+    unfinished.fetch_add(1);
+    queued.fetch_add(1);
+    try {
+      std::lock_guard lock(owner.mutex);
+      owner.tasks.push(key, task);
+    } catch (...) {
+      queued.fetch_sub(1);
+      unfinished.fetch_sub(1);
+      throw;
+    }
+    if (sleeping.load() > 0) {
+      std::lock_guard lock(idle_mutex);
+      idle_cv.notify_one();
+    }
+  }
+
+  // Blocks until every submitted task finished, then rethrows the first
+  // exception thrown by a task, if any.
+  inline void wait() {
+    std::unique_lock lock(idle_mutex);
+    done_cv.wait(lock, [&] { return unfinished.load() == 0; });
+    if (error)
+      std::rethrow_exception(std::exchange(error, nullptr));
+  }
+
+  inline size_t size() const noexcept { return workers.size(); }
+
+private:
+  inline void shutdown() noexcept {
+    {
+      std::lock_guard lock(idle_mutex);
+      stopping = true;
+    }
+    idle_cv.notify_all();
+    for (auto &thread : threads)
+      thread.join();
+    threads.clear();
+  }
+};
+
+#endif // KVFIFO_STEAL_H
@@ -0,0 +1,476 @@
+#ifndef KVFIFO_TIERED_H
+#define KVFIFO_TIERED_H
+
+#include "kvfifo.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+// kvfifo for backlogs larger than memory whose front is hot and whose back
+// is not read until much later. Elements live in three tiers, in FIFO order:
+//  - hot: a kvfifo holding the front of the queue;
+//  - cold: segments of segment_elements elements written to files in dir,
+//    each remembering how many elements of every key it holds;
+//  - tail: a kvfifo collecting the newest elements, written out as a cold
+//    segment once it is full.
+// When hot runs low the oldest segment is read back and appended to it, so
+// elements are in memory before they reach the front. first/pop(key) of a
+// key whose elements are only on disk read its segment back first; such a
+// segment stays in memory until it reaches the front. Segments remember the
+// last element of each of their keys, and spilling keeps the newest element
+// in the tail, so const back() and last() never read a segment back; the
+// non-const ones do when they have to give out a reference to the element.
+//
+// At most memory_elements elements are kept in memory, plus the segments
+// read back for keyed access. Segment files are created with mkstemp, so
+// queues of several processes may share dir. Only for trivially copyable K
+// and V, which are written as they are in memory. References returned by
+// the accessors are invalidated by the next modification.
+template <typename K, typename V> class kvfifo_tiered {
+  static_assert(std::is_trivially_copyable_v<K> &&
+                std::is_trivially_copyable_v<V>);
+
+private:
+  struct segment {
+    // number of elements of a key in the segment, and the last of them as
+    // it was written
+    struct entry {
+      K key;
+      size_t count;
+      V last;
+    };
+
+    std::string path;
+    size_t size = 0;
+    // every key in the segment, sorted; a flat array since there is one per
+    // segment on disk
+    std::vector<entry> keys;
+    // entry of the key of the last element, as the segment was written
+    size_t back = 0;
+    // elements read back from the file, which is removed then
+    std::optional<kvfifo<K, V>> loaded;
+
+    // Entry of key in the segment, null if it has no elements of key.
+    inline entry *find(const K &key) noexcept {
+      auto it = std::lower_bound(
+          keys.begin(), keys.end(), key,
+          [](const entry &e, const K &k) { return std::less<K>{}(e.key, k); });
+      if (it == keys.end() || std::less<K>{}(key, it->key) || !it->count)
+        return nullptr;
+      return &*it;
+    }
+
+    // Number of elements of key in the segment, null if there are none.
+    inline size_t *count(const K &key) noexcept {
+      entry *e = find(key);
+      return e ? &e->count : nullptr;
+    }
+
+    // Last element of key, which the segment holds, without reading it.
+    inline std::pair<const K &, const V &> last(const K &key) {
+      if (loaded)
+        return std::as_const(*loaded).last(key);
+      const entry &e = *find(key);
+      return {e.key, e.last};
+    }
+  };
+
+  std::string dir;
+  size_t memory_elements;
+  size_t segment_elements;
+
+  kvfifo<K, V> hot;
+  mutable std::deque<segment> cold;
+  kvfifo<K, V> tail;
+  // elements of every key over all tiers
+  std::map<K, size_t> counts;
+
+  // The internal queues are never copied, so references into them can be
+  // given out without marking them must_copy.
+  static inline std::pair<const K &, V &>
+  writable(std::pair<const K &, const V &> e) noexcept {
+    return {e.first, const_cast<V &>(e.second)};
+  }
+
+  // Writes all but the newest element of the tail to a new cold segment.
+  // O(s log s). If the file cannot be written the tail is left as it was.
+  inline void spill() {
+    segment seg;
+    std::vector<std::pair<K, V>> elements;
+    elements.reserve(tail.size());
+    for (auto k = tail.k_begin(); k != tail.k_end(); ++k)
+      seg.keys.push_back({*k, tail.count(*k),
+                           std::as_const(tail).last(*k).second});
+    for (kvfifo<K, V> rest = std::move(tail); !rest.empty(); rest.pop()) {
+      auto [key, val] = std::as_const(rest).front();
+      elements.emplace_back(key, val);
+    }
+    auto newest = elements.back();
+    elements.pop_back();
+    seg.find(newest.first)->count--;
+    for (const auto &[key, val] : elements)
+      seg.find(key)->last = val;
+    seg.size = elements.size();
+    seg.back = static_cast<size_t>(seg.find(elements.back().first) -
+                                   seg.keys.data());
+
+    auto restore = [&] {
+      for (const auto &[key, val] : elements)
+        tail.push(key, val);
+      tail.push(newest.first, newest.second);
+    };
+
+    // a name no other queue, in this process or another, can be using
+    seg.path = dir + "/kvfifo_XXXXXX";
+    int fd = ::mkstemp(seg.path.data());
+    if (fd < 0) {
+      int error = errno;
+      restore();
+      throw std::system_error(error, std::generic_category(),
+                              "kvfifo: mkstemp");
+    }
+    ::close(fd);
+    std::ofstream out(seg.path, std::ios::binary | std::ios::trunc);
+    for (const auto &[key, val] : elements) {
+      out.write(reinterpret_cast<const char *>(&key), sizeof(K));
+      out.write(reinterpret_cast<const char *>(&val), sizeof(V));
+    }
+    if (!out.flush()) {
+      std::remove(seg.path.c_str());
+      restore();
+      throw std::runtime_error("kvfifo: cannot write segment");
+    }
+    cold.push_back(std::move(seg));
+    tail.push(newest.first, newest.second);
+  }
+
+  // Reads segment seg back into memory, O(s log s).
+  inline void load(segment &seg) const {
+    if (seg.loaded)
+      return;
+    std::ifstream in(seg.path, std::ios::binary);
+    kvfifo<K, V> elements;
+    K key;
+    V val;
+    for (size_t i = 0; i < seg.size; ++i) {
+      if (!in.read(reinterpret_cast<char *>(&key), sizeof(K)) ||
+          !in.read(reinterpret_cast<char *>(&val), sizeof(V)))
+        throw std::runtime_error("kvfifo: cannot read segment");
+      elements.push(key, val);
+    }
+    seg.loaded = std::move(elements);
+    std::remove(seg.path.c_str());
+  }
+
+  // Appends the oldest segment to hot while hot holds less than a quarter
+  // of a segment, and moves the tail to hot once no segment is left.
+  inline void refill() {
+    while (!cold.empty() && hot.size() * 4 < segment_elements) {
+      auto &seg = cold.front();
+      load(seg);
+      kvfifo<K, V> &from = *seg.loaded;
+      while (!from.empty()) {
+        auto [key, val] = std::as_const(from).front();
+        hot.push(key, val);
+        from.pop();
+      }
+      cold.pop_front();
+    }
+    if (cold.empty() && hot.empty())
+      std::swap(hot, tail);
+  }
+
+  inline void drop_count(const K &key) noexcept {
+    auto it = counts.find(key);
+    if (--it->second == 0)
+      counts.erase(it);
+  }
+
+  inline void check_key(const K &key) const {
+    if (!counts.contains(key))
+      throw std::invalid_argument("kvfifo: key not found");
+  }
+
+  // First segment holding key, read back into memory, or nullptr.
+  inline kvfifo<K, V> *first_cold(const K &key) const {
+    for (auto &seg : cold)
+      if (seg.count(key)) {
+        load(seg);
+        return &*seg.loaded;
+      }
+    return nullptr;
+  }
+
+  // Last segment holding key, left where it is, or nullptr.
+  inline segment *last_cold(const K &key) const {
+    for (auto seg = cold.rbegin(); seg != cold.rend(); ++seg)
+      if (seg->count(key))
+        return &*seg;
+    return nullptr;
+  }
+
+  // Queue holding the first element of key, which must be present.
+  inline const kvfifo<K, V> &first_tier(const K &key) const {
+    if (hot.count(key))
+      return hot;
+    if (auto *q = first_cold(key))
+      return *q;
+    return tail;
+  }
+
+public:
+  class k_iterator {
+  private:
+    typename std::map<K, size_t>::const_iterator it;
+
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = const K;
+    using difference_type = ptrdiff_t;
+    using pointer = const K *;
+    using reference = const K &;
+
+    inline k_iterator() = default;
+    inline k_iterator(typename std::map<K, size_t>::const_iterator it)
+        : it(it) {}
+
+    inline k_iterator &operator++() noexcept {
+      ++it;
+      return *this;
+    }
+    inline k_iterator operator++(int) noexcept {
+      auto prev = *this;
+      ++it;
+      return prev;
+    }
+    inline k_iterator &operator--() noexcept {
+      --it;
+      return *this;
+    }
+    inline k_iterator operator--(int) noexcept {
+      auto prev = *this;
+      --it;
+      return prev;
+    }
+    inline bool operator==(const k_iterator &other) const noexcept {
+      return it == other.it;
+    }
+    inline reference operator*() const noexcept { return it->first; }
+    inline pointer operator->() const noexcept { return &it->first; }
+  };
+
+  // Keeps at most memory_elements elements in memory and writes the rest
+  // to dir in files of segment_elements elements, a quarter of the budget
+  // by default.
+  inline kvfifo_tiered(std::string dir, size_t memory_elements,
+                       size_t segment_elements = 0)
+      : dir(std::move(dir)), memory_elements(memory_elements),
+        segment_elements(segment_elements ? segment_elements
+                                          : std::max<size_t>(
+                                                memory_elements / 4, 1)) {
+    if (this->segment_elements * 2 > memory_elements)
+      throw std::invalid_argument("kvfifo: segments exceed the budget");
+  }
+
+  kvfifo_tiered(const kvfifo_tiered &) = delete;
+  kvfifo_tiered &operator=(const kvfifo_tiered &) = delete;
+
+  // Removes the files of the segments still on disk.
+  inline ~kvfifo_tiered() {
+    for (const auto &seg : cold)
+      if (!seg.loaded)
+        std::remove(seg.path.c_str());
+  }
+
+  // O(log n), plus writing a segment every segment_elements pushes once
+  // the budget is used up.
+  inline void push(const K &key, const V &val) {
+    ++counts[key];
+    try {
+      // hot is empty only when the whole queue is, and front() reads it
+      if (hot.empty() ||
+          (cold.empty() && tail.empty() &&
+           hot.size() + segment_elements + 1 < memory_elements))
+        hot.push(key, val);
+      else
+        tail.push(key, val);
+    } catch (...) {
+      drop_count(key);
+      throw;
+    }
+    if (tail.size() > segment_elements &&
+        hot.size() + tail.size() > memory_elements - segment_elements)
+      spill();
+  }
+
+  inline void pop() {
+    if (empty())
+      throw std::invalid_argument("kvfifo: empty");
+    drop_count(std::as_const(hot).front().first);
+    hot.pop();
+    refill();
+  }
+
+  inline void pop(const K &key) {
+    check_key(key);
+    if (hot.count(key)) {
+      hot.pop(key);
+    } else if (first_cold(key)) {
+      for (auto seg = cold.begin(); seg != cold.end(); ++seg) {
+        size_t *m = seg->count(key);
+        if (!m)
+          continue;
+        seg->loaded->pop(key);
+        --*m;
+        if (--seg->size == 0)
+          cold.erase(seg);
+        break;
+      }
+    } else {
+      tail.pop(key);
+    }
+    drop_count(key);
+    refill();
+  }
+
+  // Moves every element of key to the back. O(m log n) for m elements of
+  // the key, plus reading back the segments holding it.
+  inline void move_to_back(const K &key) {
+    check_key(key);
+    std::vector<V> moved;
+    auto take = [&](kvfifo<K, V> &q) {
+      while (q.count(key)) {
+        moved.push_back(std::as_const(q).first(key).second);
+        q.pop(key);
+      }
+    };
+    take(hot);
+    for (auto seg = cold.begin(); seg != cold.end();) {
+      if (size_t *m = seg->count(key)) {
+        load(*seg);
+        seg->size -= std::exchange(*m, 0);
+        take(*seg->loaded);
+      }
+      seg = seg->size ? std::next(seg) : cold.erase(seg);
+    }
+    take(tail);
+    counts.erase(key);
+    refill();
+    for (const auto &val : moved)
+      push(key, val);
+  }
+
+  inline std::pair<const K &, V &> front() {
+    return writable(std::as_const(*this).front());
+  }
+  inline std::pair<const K &, const V &> front() const {
+    if (empty())
+      throw std::invalid_argument("kvfifo: empty");
+    return hot.front();
+  }
+
+  // The tail is empty only once pop(key) took its last element, so this
+  // reads a segment back only then.
+  inline std::pair<const K &, V &> back() {
+    if (tail.empty() && !cold.empty())
+      load(cold.back());
+    return writable(std::as_const(*this).back());
+  }
+  inline std::pair<const K &, const V &> back() const {
+    if (empty())
+      throw std::invalid_argument("kvfifo: empty");
+    if (!tail.empty())
+      return tail.back();
+    if (!cold.empty()) {
+      auto &seg = cold.back();
+      if (seg.loaded)
+        return std::as_const(*seg.loaded).back();
+      return seg.last(seg.keys[seg.back].key);
+    }
+    return hot.back();
+  }
+
+  inline std::pair<const K &, V &> first(const K &key) {
+    return writable(std::as_const(*this).first(key));
+  }
+  inline std::pair<const K &, const V &> first(const K &key) const {
+    check_key(key);
+    return first_tier(key).first(key);
+  }
+
+  inline std::pair<const K &, V &> last(const K &key) {
+    check_key(key);
+    if (!tail.count(key))
+      if (segment *seg = last_cold(key))
+        load(*seg);
+    return writable(std::as_const(*this).last(key));
+  }
+  inline std::pair<const K &, const V &> last(const K &key) const {
+    check_key(key);
+    if (tail.count(key))
+      return tail.last(key);
+    if (segment *seg = last_cold(key))
+      return seg->last(key);
+    return hot.last(key);
+  }
+
+  inline size_t size() const noexcept {
+    size_t n = hot.size() + tail.size();
+    for (const auto &seg : cold)
+      n += seg.size;
+    return n;
+  }
+
+  inline bool empty() const noexcept { return hot.empty(); }
+
+  inline size_t count(const K &key) const noexcept {
+    auto it = counts.find(key);
+    return it == counts.end() ? 0 : it->second;
+  }
+
+  inline void clear() {
+    for (const auto &seg : cold)
+      if (!seg.loaded)
+        std::remove(seg.path.c_str());
+    cold.clear();
+    hot.clear();
+    tail.clear();
+    counts.clear();
+  }
+
+  // Elements held in memory, and segments on disk.
+  inline size_t memory_size() const noexcept {
+    size_t n = hot.size() + tail.size();
+    for (const auto &seg : cold)
+      if (seg.loaded)
+        n += seg.size;
+    return n;
+  }
+  inline size_t disk_segments() const noexcept {
+    size_t n = 0;
+    for (const auto &seg : cold)
+      n += !seg.loaded;
+    return n;
+  }
+
+  inline k_iterator k_begin() const noexcept { return counts.cbegin(); }
+  inline k_iterator k_end() const noexcept { return counts.cend(); }
+};
+
+#endif // KVFIFO_TIERED_H
@@ -0,0 +1,88 @@
+#include "../kvfifo.h"
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+// Counts every call of the replaceable global operator new to check that a
+// bounded kvfifo stops allocating once it has warmed up.
+namespace {
+size_t allocations = 0;
+}
+
+void *operator new(size_t bytes) {
+  ++allocations;
+  if (void *p = std::malloc(bytes ? bytes : 1))
+    return p;
+  throw std::bad_alloc{};
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+// Mixed traffic over 64 keys, using const accessors only: a non-const
+// accessor gives out a reference and forces the next modification to copy.
+template <typename K> void traffic(kvfifo<K, long> &q, int rounds) {
+  const auto &cq = q;
+  long sum = 0;
+  for (int i = 0; i < rounds; i++) {
+    q.push(static_cast<K>(i * 7 % 64), i);
+    if (i % 3 == 0 && cq.count(static_cast<K>(i % 64)) > 0)
+      q.pop(static_cast<K>(i % 64));
+    if (i % 11 == 0 && !q.empty())
+      q.move_to_back(cq.front().first);
+    if (i % 5 == 0 && !q.empty())
+      q.pop();
+    if (!q.empty())
+      sum += cq.back().second;
+  }
+  assert(sum > 0);
+}
+
+template <typename K> void check(kvfifo_overflow policy, const char *name) {
+  kvfifo<K, long> q({.elements = 1000, .keys = 64, .policy = policy});
+  traffic(q, 200000); // warm-up: every pool reaches its peak
+
+  size_t before = allocations;
+  traffic(q, 200000);
+  size_t steady = allocations - before;
+
+  std::printf("%s: %zu allocations in steady state, size %zu\n", name,
+              steady, q.size());
+  assert(steady == 0);
+  assert(q.size() <= q.capacity());
+}
+
+} // namespace
+
+int main() {
+  check<int>(kvfifo_overflow::drop_oldest, "int drop_oldest");
+  check<int>(kvfifo_overflow::drop_oldest_same_key,
+             "int drop_oldest_same_key");
+  check<uint16_t>(kvfifo_overflow::drop_oldest, "uint16_t drop_oldest");
+
+  kvfifo<int, long> rejecting({.elements = 2, .keys = 2});
+  rejecting.push(1, 1);
+  rejecting.push(2, 2);
+  bool thrown = false;
+  try {
+    rejecting.push(3, 3);
+  } catch (const std::length_error &) {
+    thrown = true;
+  }
+  assert(thrown && rejecting.size() == 2 && rejecting.count(3) == 0);
+
+  kvfifo<int, long> same_key({.elements = 3,
+                              .keys = 2,
+                              .policy = kvfifo_overflow::drop_oldest_same_key});
+  same_key.push(1, 1);
+  same_key.push(2, 2);
+  same_key.push(2, 3);
+  same_key.push(2, 4);
+  const auto &c = same_key;
+  assert(c.size() == 3 && c.front().second == 1 && c.first(2).second == 3);
+  same_key.push(3, 5);
+  assert(c.size() == 3 && c.front().second == 3 && c.count(1) == 0);
+}
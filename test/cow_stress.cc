@@ -0,0 +1,94 @@
+#include "../kvfifo.h"
+#include <atomic>
+#include <cassert>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct message {
+  std::string body;
+};
+template <> struct kvfifo_shared_values<message> : std::true_type {};
+
+// A queue shares its value boxes with a detached sibling that another
+// thread reads and drops; writing through front() afterwards must see the
+// box as unshared only once that thread is done with it.
+static void boxed_values() {
+  for (int r = 0; r < 500; r++) {
+    kvfifo<int, message> mine;
+    for (int i = 0; i < 4; i++)
+      mine.push(i, {std::string(64, 'a')});
+    kvfifo<int, message> sibling = mine;
+    sibling.push(9, {"detached"});
+
+    // relaxed, so that only the box count orders the reads before the write
+    std::atomic<bool> dropped{false};
+    std::thread reader([&, sibling = std::move(sibling)]() mutable {
+      size_t as = 0;
+      for (const auto &k : {0, 1, 2, 3})
+        as += std::as_const(sibling).first(k).second.body[0] == 'a';
+      assert(as == 4);
+      sibling.clear();
+      dropped.store(true, std::memory_order_relaxed);
+    });
+    while (!dropped.load(std::memory_order_relaxed))
+      std::this_thread::yield();
+    mine.front().second.body[0] = 'b';
+    reader.join();
+    assert(std::as_const(mine).front().second.body.size() == 64);
+  }
+}
+
+// Threads keep copying queues out of shared slots, mutating their copies and
+// putting them back, so states are detached while other threads copy and
+// destroy siblings sharing them. Meant to be run under ThreadSanitizer
+// (make tsan).
+int main() {
+  boxed_values();
+
+  constexpr int threads = 32, rounds = 2000, slots = 4;
+
+  kvfifo<int, int> base;
+  for (int i = 0; i < 64; i++)
+    base.push(i % 8, i);
+
+  std::vector<kvfifo<int, int>> shared(slots, base);
+  std::vector<std::mutex> locks(slots);
+
+  std::vector<std::thread> pool;
+  for (int t = 0; t < threads; t++)
+    pool.emplace_back([&, t] {
+      for (int r = 0; r < rounds; r++) {
+        int slot = (t + r) % slots;
+        kvfifo<int, int> mine;
+        {
+          std::lock_guard lock(locks[slot]);
+          mine = shared[slot];
+        }
+
+        // reads of the shared state, then a detach
+        const auto &view = mine;
+        size_t size = view.size();
+        assert(view.count(view.front().first) > 0);
+        mine.push(t, r);
+        assert(mine.size() == size + 1);
+        mine.pop();
+        if (r % 3 == 0)
+          mine.front().second = r;
+
+        kvfifo<int, int> sibling = mine;
+        if (r % 7 == 0) {
+          std::lock_guard lock(locks[slot]);
+          shared[slot] = sibling;
+        }
+        if (mine.size() > 128)
+          mine.clear();
+      }
+    });
+  for (auto &thread : pool)
+    thread.join();
+
+  assert(base.size() == 64);
+}
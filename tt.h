@@ -2,8 +2,43 @@
 #define TT_H
 
 #include "kvfifo.h"
+#include "kvfifo_async.h"
+#include "kvfifo_columnar.h"
+#include "kvfifo_journal.h"
+#include "kvfifo_mapped.h"
+#include "kvfifo_replication.h"
+#include "kvfifo_shm.h"
+#include "kvfifo_snapshot.h"
+#include "kvfifo_steal.h"
+#include "kvfifo_tiered.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <filesystem>
+#include <limits>
 #include <map>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include <utility>
+
+namespace ttt {
+// large value counting its copies, kept in shared boxes by kvfifo
+struct tt_payload {
+  static inline int copies = 0;
+  std::string body;
+  tt_payload(std::string body) : body(std::move(body)) {}
+  tt_payload(const tt_payload &other) : body(other.body) { ++copies; }
+};
+} // namespace ttt
+
+template <> struct kvfifo_shared_values<ttt::tt_payload> : std::true_type {};
 
 namespace ttt {
 bool b = false;
@@ -33,7 +68,1072 @@ public:
   }
 };
 
+// clone(pool) must give the same queue as the serial copy
+void tt_clone() {
+  kvfifo_pool pool(4);
+  kvfifo<int, int> q;
+  for (int i = 0; i < 100000; i++)
+    q.push(i % 37, i);
+
+  auto c = q.clone(pool);
+  const auto &cq = q, &cc = c;
+  assert(c.size() == q.size());
+  for (auto k = q.k_begin(); k != q.k_end(); ++k) {
+    assert(cc.count(*k) == cq.count(*k));
+    assert(cc.first(*k).second == cq.first(*k).second);
+    assert(cc.last(*k).second == cq.last(*k).second);
+  }
+
+  c.move_to_back(0);
+  c.pop(5);
+  for (int i = 0; !c.empty(); i++) {
+    assert(cc.front().first != 0 || i >= 100000 - 2703 - 1);
+    c.pop();
+  }
+  assert(q.size() == 100000);
+
+  kvfifo<int, int> shared = q;
+  shared.detach(pool);
+  shared.pop();
+  assert(cq.front().second == 0 && std::as_const(shared).front().second == 1);
+}
+
+kvfifo_task tt_consume(kvfifo_executor &, kvfifo_async<int, int> &q, int key,
+                       int &sum) {
+  auto [k, v] = key < 0 ? co_await q.async_pop() : co_await q.async_pop(key);
+  assert(key < 0 || k == key);
+  sum += v;
+}
+
+// consumers suspend on an empty queue and are resumed by matching pushes
+void tt_async() {
+  kvfifo_executor ex;
+  kvfifo_async<int, int> q(ex);
+  int sum = 0;
+
+  q.push(1, 1);
+  for (int i = 0; i < 1000; i++)
+    tt_consume(ex, q, i % 2 ? 7 : -1, sum);
+  ex.run();
+  assert(sum == 1 && q.empty() && q.waiting() == 999);
+
+  for (int i = 0; i < 499; i++)
+    q.push(3, 2);
+  ex.run();
+  assert(sum == 999 && q.empty() && q.waiting() == 500);
+
+  q.push(3, 5);
+  assert(q.size() == 1);
+  for (int i = 0; i < 500; i++)
+    q.push(7, 1);
+  ex.run();
+  assert(sum == 1499 && q.waiting() == 0);
+  assert(q.elements().front().second == 5);
+}
+
+// parallel read-only operations see every element exactly once
+void tt_bulk() {
+  kvfifo_pool pool(4);
+  for (int keys : {3, 50000}) {
+    kvfifo<int, int> q;
+    long long expected = 0;
+    for (int i = 0; i < 200000; i++) {
+      q.push(i % keys, i);
+      expected += i;
+    }
+
+    auto sum = q.transform_reduce(pool, 0LL, std::plus<long long>{},
+                                  [](int, int v) { return (long long)v; });
+    assert(sum == expected);
+    assert(q.count_if(pool, [](int k, int) { return k == 1; }) == q.count(1));
+
+    std::atomic<long long> seen{0};
+    q.for_each_parallel(pool, [&](int k, int v) {
+      assert(k == v % keys);
+      seen += v;
+    });
+    assert(seen == expected);
+  }
+}
+
+// tasks run exactly once whichever worker ends up with their bucket
+void tt_steal() {
+  std::atomic<int> sum{0};
+  {
+    kvfifo_stealing_pool<int> pool(4);
+    for (int i = 0; i < 10000; i++)
+      pool.submit(i % 3, [&sum, i] { sum += i; });
+    pool.wait();
+    assert(sum == 10000 * 9999 / 2);
+
+    pool.submit(1, [] { throw std::runtime_error{"task"}; });
+    bool thrown = false;
+    try {
+      pool.wait();
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    assert(thrown);
+
+    for (int i = 0; i < 100; i++)
+      pool.submit(i, [&sum] { sum -= 1; });
+  }
+  assert(sum == 10000 * 9999 / 2 - 100);
+}
+
+// shared states are reported once by the census
+void tt_memory() {
+  kvfifo<int, int> q;
+  assert(q.memory_usage().total() == 0);
+  for (int i = 0; i < 100; i++)
+    q.push(i % 2, i);
+
+  auto usage = q.memory_usage();
+  assert(!usage.shared && usage.owners == 1);
+  assert(usage.list_bytes >= 100 * sizeof(std::pair<int, int>));
+  assert(usage.map_bytes > 0 && usage.bucket_bytes >= 100 * sizeof(void *));
+
+  std::vector<kvfifo<int, int>> copies(10, q);
+  assert(q.memory_usage().owners == 11 && q.memory_usage().shared);
+
+  kvfifo_memory_census census;
+  census.add(q);
+  for (const auto &c : copies)
+    census.add(c);
+  copies[0].pop();
+  census.add(copies[0]);
+  assert(census.queues_seen() == 12 && census.states() == 2);
+  assert(census.shared_bytes() == usage.total());
+  assert(census.unique_bytes() == copies[0].memory_usage().total());
+}
+
+// every element refers to the single copy of its key held by the index
+void tt_interned() {
+  kvfifo<std::string, int> q;
+  for (int i = 0; i < 40000; i++)
+    q.push(std::string(40, 'a' + i % 5), i);
+  const auto &cq = q;
+  assert(&cq.front().first == &*cq.k_begin());
+
+  kvfifo_pool pool(3);
+  const auto c = q.clone(pool);
+  for (auto k = c.k_begin(); k != c.k_end(); ++k) {
+    assert(&c.first(*k).first == &*k && &c.last(*k).first == &*k);
+    assert(c.last(*k).second == cq.last(*k).second);
+  }
+
+  q.pop();
+  q.move_to_back(std::string(40, 'b'));
+  assert(&cq.back().first == &cq.last(std::string(40, 'b')).first);
+  assert(cq.front().first == std::string(40, 'c'));
+}
+
+enum class tt_shard : uint16_t { low = 3, mid = 4000, high = 65535 };
+
+// small integral and enum keys use the flat index, ordered like std::map
+void tt_direct() {
+  static_assert(kvfifo_direct_index<uint16_t>::value &&
+                kvfifo_direct_index<tt_shard>::value &&
+                !kvfifo_direct_index<int>::value &&
+                !kvfifo_direct_index<bool>::value);
+
+  kvfifo<int8_t, int> q;
+  for (int i = 0; i < 1000; i++)
+    q.push(static_cast<int8_t>(i * 37 % 256 - 128), i);
+  int8_t prev = -128;
+  size_t keys = 0;
+  for (auto k = q.k_begin(); k != q.k_end(); ++k, ++keys) {
+    assert(keys == 0 || *k > prev);
+    prev = *k;
+  }
+  assert(keys == 256 && prev == 127);
+  auto k = q.k_end();
+  --k;
+  assert(*k == 127 && *q.k_begin() == -128);
+
+  const auto &cq = q;
+  assert(cq.count(-128) == 4 && cq.first(-128).second == 0);
+  q.move_to_back(-128);
+  assert(cq.back().first == -128 && cq.last(-128).second == 768);
+  while (cq.front().first != -128)
+    q.pop();
+  assert(q.size() == 4);
+
+  kvfifo<tt_shard, int> shards;
+  shards.push(tt_shard::high, 1);
+  shards.push(tt_shard::low, 2);
+  shards.push(tt_shard::mid, 3);
+  shards.push(tt_shard::high, 4);
+  assert(*shards.k_begin() == tt_shard::low);
+  assert(*--shards.k_end() == tt_shard::high);
+  assert(*++shards.k_begin() == tt_shard::mid);
+  shards.pop();
+  assert(shards.count(tt_shard::high) == 1);
+  assert(std::as_const(shards).first(tt_shard::high).second == 4);
+  kvfifo_pool pool(2);
+  assert(shards.clone(pool).size() == 3);
+
+  kvfifo<uint16_t, int> big;
+  for (int i = 0; i < 50000; i++)
+    big.push(static_cast<uint16_t>(i * 7919 % 5000), i);
+  const auto c = big.clone(pool);
+  for (auto k = big.k_begin(); k != big.k_end(); ++k)
+    assert(c.count(*k) == 10 && c.last(*k).second == std::as_const(big).last(*k).second);
+}
+
+// the mapped queue behaves like kvfifo and keeps its contents in the file
+void tt_mapped() {
+  std::string path = "/tmp/kvfifo_tt_" + std::to_string(::getpid());
+  ::unlink(path.c_str());
+  kvfifo<int, long> ref;
+  {
+    kvfifo_mapped<int, long> q(path, 4096);
+    for (long i = 0; i < 30000; i++) {
+      int key = static_cast<int>(i * 7919 % 97);
+      q.push(key, i);
+      ref.push(key, i);
+      if (i % 3 == 0) {
+        q.pop();
+        ref.pop();
+      }
+      if (i % 7 == 0 && ref.count(key) > 0) {
+        q.pop(key);
+        ref.pop(key);
+      }
+      if (i % 13 == 0 && !ref.empty() && ref.count(key) > 0) {
+        q.move_to_back(key % 2 ? key : q.front().first);
+        ref.move_to_back(key % 2 ? key : std::as_const(ref).front().first);
+      }
+    }
+    assert(q.region_bytes() > 4096);
+  }
+
+  kvfifo_mapped<int, long> q(path);
+  const auto &cref = ref;
+  assert(q.size() == ref.size() && q.front().second == cref.front().second &&
+         q.back().second == cref.back().second);
+  auto k = q.k_begin();
+  for (auto r = ref.k_begin(); r != ref.k_end(); ++r, ++k) {
+    assert(*k == *r && q.count(*r) == ref.count(*r));
+    assert(q.first(*r).second == cref.first(*r).second);
+    assert(q.last(*r).second == cref.last(*r).second);
+  }
+  assert(k == q.k_end() && *--q.k_end() == *--ref.k_end());
+  while (!ref.empty()) {
+    assert(q.front().second == cref.front().second);
+    q.pop();
+    ref.pop();
+  }
+  assert(q.empty() && q.k_begin() == q.k_end() && q.count(1) == 0);
+
+  q.push(1, 1);
+  q.clear();
+  assert(q.empty());
+  ::unlink(path.c_str());
+
+  bool thrown = false;
+  try {
+    kvfifo_mapped<int, long> other("/dev/null");
+  } catch (const std::exception &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+// the tiered queue matches kvfifo while most elements sit on disk
+void tt_tiered() {
+  char dir[] = "/tmp/kvfifo_tt_XXXXXX";
+  assert(::mkdtemp(dir));
+  kvfifo<int, long> ref;
+  const auto &cref = ref;
+  {
+    kvfifo_tiered<int, long> q(dir, 64, 16);
+    size_t spilled = 0;
+    for (long i = 0; i < 20000; i++) {
+      int key = static_cast<int>(i * 7919 % 31);
+      q.push(key, i);
+      ref.push(key, i);
+      if (i % 3 == 0) {
+        assert(q.front().second == cref.front().second);
+        q.pop();
+        ref.pop();
+      }
+      if (i % 11 == 0 && ref.count(key)) {
+        assert(q.first(key).second == cref.first(key).second);
+        q.pop(key);
+        ref.pop(key);
+      }
+      if (i % 101 == 0 && ref.count(key)) {
+        q.move_to_back(key);
+        ref.move_to_back(key);
+      }
+      if (i % 257 == 0)
+        for (auto k = ref.k_begin(); k != ref.k_end(); ++k)
+          if (ref.count(*k)) {
+            assert(q.count(*k) == ref.count(*k));
+            assert(q.last(*k).second == cref.last(*k).second);
+          }
+      spilled = std::max(spilled, q.disk_segments());
+      assert(q.size() == ref.size());
+      assert(ref.empty() || q.back().second == cref.back().second);
+    }
+    assert(spilled > 10);
+    q.pop(static_cast<const kvfifo_tiered<int, long> &>(q).back().first);
+    q.clear();
+    assert(q.empty() && q.k_begin() == q.k_end());
+    for (long i = 0; i < 1000; i++)
+      q.push(static_cast<int>(i % 7), i);
+    assert(q.memory_size() <= 64 && q.disk_segments() > 0);
+
+    // the smallest budget, segments of one element
+    kvfifo_tiered<int, long> tiny(dir, 2);
+    tiny.push(1, 10);
+    assert(!tiny.empty() && tiny.size() == 1 && tiny.front().second == 10);
+    for (long i = 11; i < 20; i++)
+      tiny.push(static_cast<int>(i % 3), i);
+    assert(tiny.memory_size() <= 2 && tiny.disk_segments() > 0);
+    for (long i = 10; i < 20; i++) {
+      assert(tiny.front().second == i);
+      tiny.pop();
+    }
+    assert(tiny.empty() && tiny.size() == 0);
+
+    // back() and last() after every push read no segment back
+    kvfifo_tiered<int, long> p(dir, 1000);
+    for (long i = 0; i < 100000; i++) {
+      p.push(static_cast<int>(i % 7), i);
+      assert(p.back().second == i);
+      assert(std::as_const(p).last(static_cast<int>(i % 7)).second == i);
+      assert(std::as_const(p).last(0).second == i - i % 7);
+    }
+    assert(p.memory_size() <= 1000 && p.disk_segments() > 300);
+    // a spill keeps the newest element in the tail; popping it leaves the
+    // back in a segment, which the const accessors do not read
+    size_t segments = p.disk_segments();
+    long i = 100000;
+    for (; p.disk_segments() == segments; i++)
+      p.push(static_cast<int>(i), i);
+    size_t resident = p.memory_size();
+    p.pop(static_cast<int>(i - 1));
+    assert(std::as_const(p).back().second == i - 2);
+    assert(std::as_const(p).last(static_cast<int>(i - 2)).second == i - 2);
+    assert(p.memory_size() == resident - 1);
+    assert(p.back().second == i - 2);
+    assert(p.memory_size() > resident);
+  }
+  assert(std::filesystem::is_empty(dir));
+  std::filesystem::remove(dir);
+}
+
+// a huge page queue carves its nodes from 2 MiB slabs and behaves as usual
+void tt_huge_pages() {
+  kvfifo<int, long> q({.huge_pages = true});
+  kvfifo<int, long> ref;
+  for (long i = 0; i < 100000; i++) {
+    q.push(static_cast<int>(i % 1000), i);
+    ref.push(static_cast<int>(i % 1000), i);
+  }
+  auto usage = q.memory_usage();
+  assert(q.capacity() == 0 && usage.arena_bytes >= usage.total());
+  assert(usage.slab_bytes % kvfifo_arena::huge_page == 0);
+
+  q.move_to_back(3);
+  ref.move_to_back(3);
+  kvfifo_pool pool(2);
+  const auto c = q.clone(pool);
+  assert(c.memory_usage().arena_bytes > 0);
+  for (int i = 0; i < 50000; i++) {
+    assert(std::as_const(q).front().second == std::as_const(ref).front().second);
+    q.pop();
+    ref.pop();
+  }
+  assert(c.size() == 100000 && std::as_const(c).back().first == 3);
+}
+
+// keys whose last element is removed leave the index, by every path
+void tt_churn() {
+  kvfifo<int, int> q;
+  for (int i = 0; i < 1000; i++) {
+    q.push(i, i);
+    q.push(i, -i);
+    q.pop(i);
+    q.pop(i);
+  }
+  assert(q.empty() && q.k_begin() == q.k_end());
+  bool thrown = false;
+  try {
+    q.first(7);
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  assert(thrown && q.count(7) == 0);
+
+  kvfifo<uint16_t, int> direct;
+  direct.push(1, 1);
+  direct.push(2, 2);
+  direct.pop(1);
+  direct.move_to_back(2);
+  assert(*direct.k_begin() == 2 && ++direct.k_begin() == direct.k_end());
+
+  kvfifo<int, int> same_key({.elements = 2,
+                             .policy = kvfifo_overflow::drop_oldest_same_key});
+  same_key.push(1, 1);
+  same_key.push(2, 2);
+  same_key.push(3, 3);
+  assert(*same_key.k_begin() == 2 && same_key.count(1) == 0);
+}
+
+// copies share boxed values; writing through a reference copies only that
+// value, and the write stays in its own queue
+void tt_shared_values() {
+  kvfifo<int, tt_payload> q;
+  for (int i = 0; i < 1000; i++)
+    q.push(i % 10, tt_payload(std::string(100, 'a')));
+  int pushed = tt_payload::copies;
+
+  kvfifo<int, tt_payload> c = q;
+  c.pop();
+  c.push(3, tt_payload("x"));
+  kvfifo_pool pool(2);
+  auto cloned = q.clone(pool);
+  assert(tt_payload::copies == pushed + 1);
+
+  c.front().second.body = "written";
+  assert(tt_payload::copies == pushed + 2);
+  assert(std::as_const(q).first(1).second.body == std::string(100, 'a'));
+
+  // c gave out a reference, so a copy of c copies that one value
+  kvfifo<int, tt_payload> d = c;
+  assert(tt_payload::copies == pushed + 3);
+  c.front().second.body = "again";
+  assert(std::as_const(d).front().second.body == "written");
+  assert(std::as_const(c).front().second.body == "again");
+  assert(d.size() == 1000 && cloned.size() == 1000);
+}
+
+template <typename K, typename V>
+bool tt_same(kvfifo<K, V> a, kvfifo<K, V> b) {
+  if (a.size() != b.size())
+    return false;
+  for (auto k = a.k_begin(), l = b.k_begin(); k != a.k_end(); ++k, ++l)
+    if (*k != *l || a.count(*k) != b.count(*k))
+      return false;
+  for (; !a.empty(); a.pop(), b.pop())
+    if (std::as_const(a).front() != std::as_const(b).front())
+      return false;
+  return true;
+}
+
+// serialized queues read back equal, from streams and from memory
+void tt_serialize() {
+  kvfifo<int, long> q;
+  for (long i = 0; i < 5000; i++)
+    q.push(static_cast<int>(i * 7919 % 101), i);
+  q.move_to_back(5);
+  for (bool indexed : {true, false}) {
+    std::stringstream ss;
+    q.serialize(ss, indexed);
+    std::string bytes = ss.str();
+    assert(tt_same(q, kvfifo<int, long>::deserialize(ss)));
+    auto loaded = kvfifo<int, long>::deserialize(bytes.data(), bytes.size());
+    assert(tt_same(q, loaded));
+    loaded.push(5, -1);
+    assert(std::as_const(loaded).last(5).second == -1);
+
+    bool thrown = false;
+    try {
+      kvfifo<int, long>::deserialize(bytes.data(), bytes.size() - 1);
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  kvfifo<std::string, std::vector<char>> s;
+  for (int i = 0; i < 300; i++)
+    s.push(std::to_string(i % 17), std::vector<char>(i, 'v'));
+  std::stringstream ss;
+  s.serialize(ss);
+  assert(tt_same(s, kvfifo<std::string, std::vector<char>>::deserialize(ss)));
+
+  kvfifo<uint16_t, int> d;
+  for (int i = 0; i < 1000; i++)
+    d.push(static_cast<uint16_t>(i * 31 % 700), i);
+  std::stringstream ds;
+  d.serialize(ds);
+  assert(tt_same(d, kvfifo<uint16_t, int>::deserialize(ds)));
+
+  std::stringstream empty;
+  kvfifo<int, long>().serialize(empty);
+  assert((kvfifo<int, long>::deserialize(empty).empty()));
+
+  // crafted key counts are rejected before they size anything
+  auto crafted = [](uint64_t elements, std::vector<uint64_t> counts,
+                    std::vector<uint32_t> at) {
+    std::string bytes;
+    auto put = [&](const auto &v) {
+      bytes.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    };
+    put(uint32_t{0x3146564b});
+    put(uint32_t{1});
+    put(elements);
+    put(uint64_t{counts.size()});
+    for (size_t i = 0; i < counts.size(); i++) {
+      put(static_cast<int>(i));
+      put(counts[i]);
+    }
+    for (uint32_t i : at) {
+      put(i);
+      put(long{0});
+    }
+    try {
+      kvfifo<int, long>::deserialize(bytes.data(), bytes.size());
+    } catch (const std::runtime_error &) {
+      return true;
+    }
+    return false;
+  };
+  assert(crafted(0x100000001, {0x100000001}, {0}));
+  assert(crafted(0x80000000, {0x80000000}, {0, 0}));
+  assert(crafted(2, {1, 2}, {0, 1, 1}));
+  assert(crafted(3, {1, 1}, {0, 1, 1}));
+  assert(crafted(2, {1, 1}, {0, 0}));
+  assert(!crafted(2, {1, 1}, {1, 0}));
+}
+
+// value whose encoding fails when it is negative
+struct tt_unwritable {
+  int v;
+};
+} // namespace ttt
+
+template <> struct kvfifo_codec<ttt::tt_unwritable> {
+  template <typename Sink>
+  static inline void write(Sink &out, const ttt::tt_unwritable &u) {
+    if (u.v < 0)
+      throw std::runtime_error("unwritable");
+    out.write(&u.v, sizeof(u.v));
+  }
+  template <typename Source> static inline ttt::tt_unwritable read(Source &in) {
+    ttt::tt_unwritable u;
+    in.read(&u.v, sizeof(u.v));
+    return u;
+  }
+};
+
+namespace ttt {
+// a journaled queue comes back from its log, also after a torn write
+void tt_journal() {
+  std::string path = "/tmp/kvfifo_tt_log_" + std::to_string(::getpid());
+  ::unlink(path.c_str());
+  kvfifo<int, std::string> ref;
+  {
+    kvfifo_journaled<int, std::string> q(path, {.group_bytes = 256});
+    for (int i = 0; i < 2000; i++) {
+      q.push(i % 13, std::to_string(i));
+      ref.push(i % 13, std::to_string(i));
+      if (i % 3 == 0) {
+        q.pop();
+        ref.pop();
+      }
+      if (i % 7 == 0 && ref.count(i % 5)) {
+        q.pop(i % 5);
+        ref.pop(i % 5);
+      }
+      if (i % 11 == 0 && ref.count(i % 13)) {
+        q.move_to_back(i % 13);
+        ref.move_to_back(i % 13);
+      }
+      if (i == 1000) {
+        q.clear();
+        ref.clear();
+      }
+    }
+    bool thrown = false;
+    try {
+      q.pop(100);
+    } catch (const std::invalid_argument &) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+  assert(tt_same(ref, kvfifo_journaled<int, std::string>::replay(path)));
+
+  {
+    std::ofstream torn(path, std::ios::binary | std::ios::app);
+    torn.write("\x20\0\0\0\0\1\0", 7);
+  }
+  {
+    kvfifo_journaled<int, std::string> q(path, {.fsync = kvfifo_fsync::never});
+    assert(tt_same(ref, q.elements()));
+    q.push(1, "after");
+    ref.push(1, "after");
+  }
+  assert(tt_same(ref, kvfifo_journaled<int, std::string>::replay(path)));
+  ::unlink(path.c_str());
+
+  // an operation that cannot be logged is not applied either
+  {
+    kvfifo_journaled<int, tt_unwritable> q(path);
+    q.push(1, {1});
+    bool thrown = false;
+    try {
+      q.push(2, {-1});
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    assert(thrown && q.size() == 1 && q.count(2) == 0);
+    q.push(3, {3});
+  }
+  auto replayed = kvfifo_journaled<int, tt_unwritable>::replay(path);
+  assert(replayed.size() == 2 && std::as_const(replayed).back().second.v == 3);
+  ::unlink(path.c_str());
+}
+
+// a snapshot holds the queue as it was when it started
+void tt_snapshot() {
+  std::string path = "/tmp/kvfifo_tt_snap_" + std::to_string(::getpid());
+  kvfifo<int, std::string> q;
+  for (int i = 0; i < 5000; i++)
+    q.push(i % 17, std::to_string(i));
+  kvfifo<int, std::string> ref = q;
+
+  kvfifo_snapshot snap(q, path);
+  for (int i = 0; i < 2000; i++) {
+    q.pop();
+    q.push(i % 3, "live");
+  }
+  snap.wait();
+  assert(snap.ready());
+  {
+    std::ifstream in(path, std::ios::binary);
+    assert(tt_same(ref, kvfifo<int, std::string>::deserialize(in)));
+  }
+
+  kvfifo_snapshot bad(q, "/nonexistent/dir/snap");
+  bool thrown = false;
+  try {
+    bad.wait();
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+  ::unlink(path.c_str());
+}
+
+// processes share a queue in place, and survive one dying with the lock
+void tt_shm() {
+  std::string name = "/kvfifo_tt_" + std::to_string(::getpid());
+  kvfifo_shm_region::remove(name);
+  kvfifo_shared<int, long> q(name, 1 << 16);
+
+  pid_t child = ::fork();
+  if (child == 0) {
+    kvfifo_shared<int, long> other(name);
+    for (long i = 0; i < 1000; i++) {
+      std::lock_guard lock(other.storage());
+      other.push(static_cast<int>(i % 10), i);
+    }
+    other.storage().lock();
+    ::_exit(0);
+  }
+  int status;
+  ::waitpid(child, &status, 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  {
+    std::lock_guard lock(q.storage());
+    assert(q.storage().owner_died());
+    q.storage().reset_owner_died();
+    assert(q.size() == 1000 && q.count(3) == 100);
+    assert(q.first(3).second == 3 && q.last(3).second == 993);
+    for (long i = 0; i < 1000; i++) {
+      assert(q.front().second == i);
+      q.pop();
+    }
+
+    bool thrown = false;
+    try {
+      for (long i = 0;; i++)
+        q.push(static_cast<int>(i), i);
+    } catch (const std::length_error &) {
+      thrown = true;
+    }
+    assert(thrown && q.size() > 0);
+    size_t full = q.size();
+    q.pop();
+    q.push(-1, -1);
+    assert(q.size() == full && q.back().second == -1);
+  }
+  kvfifo_shm_region::remove(name);
+}
+
+// applying diff(base, updated) to base gives updated
+void tt_delta() {
+  kvfifo<int, std::string> base;
+  for (int i = 0; i < 300; i++)
+    base.push(i % 11, std::to_string(i));
+
+  kvfifo<int, std::string> copy = base;
+  assert((kvfifo<int, std::string>::diff(base, copy).empty()));
+
+  uint32_t seed = 7;
+  auto next = [&] { return seed = seed * 1103515245 + 12345, seed >> 16; };
+  for (int round = 0; round < 200; round++) {
+    kvfifo<int, std::string> updated = base;
+    for (int n = next() % 20; n > 0; n--) {
+      int key = static_cast<int>(next() % 13);
+      switch (next() % (round % 50 == 0 ? 5 : 4)) {
+      case 0:
+        updated.push(key, "u" + std::to_string(n));
+        break;
+      case 1:
+        if (!updated.empty())
+          updated.pop();
+        break;
+      case 2:
+        if (updated.count(key))
+          updated.pop(key);
+        break;
+      case 3:
+        if (updated.count(key))
+          updated.move_to_back(key);
+        break;
+      default:
+        updated.clear();
+      }
+    }
+    auto d = kvfifo<int, std::string>::diff(base, updated);
+    assert(d.edits.size() <= updated.size() + 1);
+    kvfifo<int, std::string> replica = base;
+    replica.apply(d);
+    assert(tt_same(replica, updated));
+  }
+
+  kvfifo<int, std::string> moved = base;
+  moved.move_to_back(3);
+  moved.pop();
+  auto d = kvfifo<int, std::string>::diff(base, moved);
+  assert(d.edits.size() == 2 && d.edits[0].op == kvfifo_edit::pop &&
+         d.edits[1].op == kvfifo_edit::move_to_back && d.edits[1].key == 3);
+}
+
+// a queue built from a range equals one built by pushes
+void tt_range() {
+  std::vector<std::pair<int, std::string>> pairs;
+  for (int i = 0; i < 3000; i++)
+    pairs.emplace_back(i * 7919 % 101, std::to_string(i));
+  kvfifo<int, std::string> pushed;
+  for (const auto &[key, val] : pairs)
+    pushed.push(key, val);
+  assert(tt_same(pushed, kvfifo<int, std::string>(pairs.begin(), pairs.end())));
+
+  std::sort(pairs.begin(), pairs.end());
+  kvfifo<int, std::string> grouped;
+  for (const auto &[key, val] : pairs)
+    grouped.push(key, val);
+  assert(tt_same(grouped, kvfifo<int, std::string>(pairs)));
+  auto moved = pairs;
+  assert(tt_same(grouped, kvfifo<int, std::string>(
+                              std::make_move_iterator(moved.begin()),
+                              std::make_move_iterator(moved.end()))));
+
+  std::map<short, long> ascending{{3, 30}, {-1, -10}, {7, 70}};
+  kvfifo<short, long> direct(ascending);
+  assert(direct.size() == 3 && direct.front().second == -10 &&
+         direct.count(7) == 1);
+  assert((kvfifo<int, int>(std::vector<std::pair<int, int>>{}).empty()));
+
+  kvfifo<int, std::string> slabs(pairs, {.huge_pages = true});
+  assert(tt_same(grouped, slabs));
+  kvfifo<int, std::string> last(pairs, {.elements = 10,
+                                        .policy = kvfifo_overflow::drop_oldest});
+  assert(last.size() == 10 && last.back().second == pairs.back().second);
+  bool thrown = false;
+  try {
+    kvfifo<int, std::string> full(pairs, {.elements = 10});
+  } catch (const std::length_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+// a follower mirrors its primary, resumes from the backlog or a snapshot,
+// and notices a gap
+void tt_replication() {
+  int a[2], b[2], c[2];
+  assert(::pipe(a) == 0 && ::pipe(b) == 0 && ::pipe(c) == 0);
+  kvfifo_replicated<int, std::string> primary(a[1], {.batch_bytes = 512});
+  kvfifo_follower<int, std::string> follower(a[0]);
+  auto sync = [&] {
+    primary.flush();
+    while (follower.applied() < primary.seq())
+      assert(follower.receive());
+    assert(tt_same(primary.elements(), follower.elements()));
+  };
+  auto work = [&](int from, int to) {
+    for (int i = from; i < to; i++) {
+      primary.push(i % 7, std::to_string(i));
+      if (i % 3 == 0)
+        primary.pop();
+      if (i % 10 == 0)
+        primary.move_to_back(i % 7);
+      if (i % 11 == 0 && primary.count(i % 5))
+        primary.pop(i % 5);
+      if (i % 400 == 0)
+        primary.clear();
+      if (i % 50 == 0)
+        sync();
+    }
+  };
+  work(1, 1000);
+  sync();
+
+  // ops written to a connection the follower lost are resent on resuming
+  primary.push(1, "lost");
+  primary.flush();
+  primary.attach(b[1], follower.applied());
+  follower.attach(b[0]);
+  work(1000, 1200);
+  sync();
+
+  // a follower behind the backlog gets a snapshot
+  kvfifo_replicated<int, std::string> small(c[1], {.backlog_bytes = 1});
+  kvfifo_follower<int, std::string> late(c[0]);
+  for (int i = 0; i < 100; i++)
+    small.push(i, "x");
+  small.flush();
+  for (int i = 0; i < 50; i++)
+    small.pop();
+  small.attach(c[1], 0);
+  late.attach(c[0]);
+  while (late.applied() < small.seq())
+    assert(late.receive());
+  assert(tt_same(small.elements(), late.elements()));
+
+  // claiming to be up to date skips operations, which the follower notices
+  primary.push(2, "skipped");
+  primary.attach(b[1], primary.seq());
+  primary.push(3, "after");
+  primary.flush();
+  bool thrown = false;
+  try {
+    follower.receive();
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  // an operation that cannot be encoded is neither applied nor numbered
+  int d[2];
+  assert(::pipe(d) == 0);
+  {
+    kvfifo_replicated<int, tt_unwritable> p(d[1]);
+    kvfifo_follower<int, tt_unwritable> f(d[0]);
+    p.push(1, {1});
+    thrown = false;
+    try {
+      p.push(2, {-1});
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+    assert(thrown && p.seq() == 1 && p.size() == 1);
+    p.push(3, {3});
+    p.flush();
+    while (f.applied() < p.seq())
+      assert(f.receive());
+    assert(f.size() == 2 && f.count(2) == 0 && f.count(3) == 1);
+  }
+
+  for (int fd : {a[0], a[1], b[0], b[1], c[0], c[1], d[0], d[1]})
+    ::close(fd);
+}
+
+// queues read back equal from columns, which count keys without loading
+struct tt_point {
+  int x, y;
+  bool operator==(const tt_point &) const = default;
+};
+
+void tt_columnar() {
+  kvfifo<long, int> ints;
+  kvfifo<std::string, std::string> strings;
+  kvfifo<int, tt_point> points;
+  for (int i = 0; i < 5000; i++) {
+    ints.push((i % 2 ? -1L : 1L) * (i * 7919 % 211) << (i % 40), i - 2500);
+    strings.push("key" + std::to_string(i % 37), std::to_string(i % 5));
+    points.push(i % 3, {i, -i});
+  }
+  ints.push(LONG_MIN, INT_MAX);
+  ints.push(LONG_MAX, INT_MIN);
+
+  for (size_t segment : {size_t{1}, size_t{100}, size_t{1} << 16}) {
+    std::stringstream a, b, c;
+    kvfifo_columnar<long, int>::write(a, ints, segment);
+    kvfifo_columnar<std::string, std::string>::write(b, strings, segment);
+    kvfifo_columnar<int, tt_point>::write(c, points, segment);
+    std::string as = a.str(), bs = b.str();
+
+    assert(tt_same(ints, kvfifo_columnar<long, int>::read(a)));
+    assert(tt_same(strings, kvfifo_columnar<std::string, std::string>::read(b)));
+    auto loaded = kvfifo_columnar<int, tt_point>::read(c);
+    assert(loaded.size() == points.size() && loaded.count(2) == points.count(2));
+
+    for (long key : {0L, 211L, -1L, LONG_MIN, 5L}) {
+      std::istringstream in(as);
+      assert((kvfifo_columnar<long, int>::count(in, key) == ints.count(key)));
+    }
+    for (std::string key : {"key0", "key36", "key37", "a"}) {
+      std::istringstream in(bs);
+      assert((kvfifo_columnar<std::string, std::string>::count(in, key) ==
+              strings.count(key)));
+    }
+  }
+
+  // floating point values come back bit for bit, NaN and signed zeros too
+  kvfifo<float, double> reals;
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  for (double v : {1.0, nan, -0.0, 0.0, -0.0})
+    reals.push(-1.5f, v);
+  reals.push(2.5f, -0.0);
+  std::stringstream r;
+  kvfifo_columnar<float, double>::write(r, reals, 4);
+  std::string rs = r.str();
+  auto back = kvfifo_columnar<float, double>::read(r);
+  assert(back.size() == reals.size());
+  for (; !reals.empty(); reals.pop(), back.pop()) {
+    double a = reals.front().second, b = back.front().second;
+    assert(reals.front().first == back.front().first);
+    assert((std::memcmp(&a, &b, sizeof(a)) == 0));
+  }
+  std::istringstream rin(rs);
+  assert((kvfifo_columnar<float, double>::count(rin, -1.5f) == 5));
+  kvfifo<int, float> fs;
+  fs.push(1, std::numeric_limits<float>::quiet_NaN());
+  fs.push(2, -0.0f);
+  std::stringstream f;
+  kvfifo_columnar<int, float>::write(f, fs);
+  auto fback = kvfifo_columnar<int, float>::read(f);
+  assert(std::isnan(fback.first(1).second));
+  assert(std::signbit(fback.first(2).second));
+
+  std::stringstream empty;
+  kvfifo_columnar<int, int>::write(empty, kvfifo<int, int>());
+  assert((kvfifo_columnar<int, int>::read(empty).empty()));
+  // column sizes whose sum wraps around are rejected, not followed
+  kvfifo<int, int> few;
+  for (int i = 0; i < 10; i++)
+    few.push(i % 3, i);
+  std::stringstream sizes;
+  kvfifo_columnar<int, int>::write(sizes, few);
+  // key bytes at 16, value bytes at 24: first one, then the other, then both
+  for (unsigned fields : {1u, 2u, 3u}) {
+    std::string bytes = sizes.str();
+    for (size_t at : {size_t{16}, size_t{24}})
+      if (fields & (at == 16 ? 1u : 2u)) {
+        uint64_t field;
+        std::memcpy(&field, bytes.data() + at, sizeof(field));
+        field += uint64_t{1} << 63;
+        std::memcpy(bytes.data() + at, &field, sizeof(field));
+      }
+    for (bool counting : {false, true}) {
+      std::istringstream in(bytes);
+      bool bad = false;
+      try {
+        if (counting)
+          kvfifo_columnar<int, int>::count(in, 1);
+        else
+          kvfifo_columnar<int, int>::read(in);
+      } catch (const std::runtime_error &) {
+        bad = true;
+      }
+      assert(bad);
+    }
+  }
+
+  std::istringstream truncated(std::string("KVC1", 4) + "\x05");
+  bool thrown = false;
+  try {
+    kvfifo_columnar<int, int>::read(truncated);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+// dumps read the state in place, in either order and style
+void tt_dump() {
+  kvfifo<int, std::string> q;
+  q.push(2, "a");
+  q.push(1, "say \"hi\"\n");
+  q.push(2, "b");
+  q.front().second = "A"; // a reference was given out
+  kvfifo<int, std::string> shared = q;
+  const void *state = q.memory_usage().state;
+
+  std::ostringstream text, json, grouped, cut;
+  assert(q.dump(text) == 3);
+  assert(text.str() == "2\tA\n1\tsay \"hi\"\n\n2\tb\n");
+  q.dump(json, {.style = kvfifo_dump_style::json});
+  assert(json.str() == "{\"key\":2,\"value\":\"A\"}\n"
+                       "{\"key\":1,\"value\":\"say \\\"hi\\\"\\n\"}\n"
+                       "{\"key\":2,\"value\":\"b\"}\n");
+  q.dump(grouped, {.by_key = true});
+  assert(grouped.str() == "1\tsay \"hi\"\n\n2\tA\n2\tb\n");
+  assert(q.dump(cut, {.style = kvfifo_dump_style::json, .rows = 1}) == 1);
+  assert(cut.str() == "{\"key\":2,\"value\":\"A\"}\n{\"omitted\":2}\n");
+  assert(q.memory_usage().state == state);
+
+  // enum and int8_t/uint8_t keys are numbers, plain chars characters
+  enum class color : uint8_t { red = 3, blue = 200 };
+  kvfifo<color, int8_t> e;
+  e.push(color::blue, 7);
+  e.push(color::red, -1);
+  std::ostringstream etext, ejson;
+  e.dump(etext);
+  assert(etext.str() == "200\t7\n3\t-1\n");
+  e.dump(ejson, {.style = kvfifo_dump_style::json});
+  assert(ejson.str() == "{\"key\":200,\"value\":7}\n"
+                        "{\"key\":3,\"value\":-1}\n");
+  kvfifo<uint8_t, char> u;
+  u.push(7, 'x');
+  std::ostringstream utext, ujson;
+  u.dump(utext);
+  assert(utext.str() == "7\tx\n");
+  u.dump(ujson, {.style = kvfifo_dump_style::json});
+  assert(ujson.str() == "{\"key\":7,\"value\":\"x\"}\n");
+
+  struct opaque {};
+  kvfifo<std::string, opaque> o;
+  o.push("k", {});
+  std::ostringstream none;
+  o.dump(none, {.style = kvfifo_dump_style::json});
+  assert(none.str() == "{\"key\":\"k\",\"value\":null}\n");
+}
+
 void tt_main() {
+  tt_dump();
+  tt_columnar();
+  tt_replication();
+  tt_range();
+  tt_delta();
+  tt_shm();
+  tt_snapshot();
+  tt_journal();
+  tt_serialize();
+  tt_shared_values();
+  tt_churn();
+  tt_huge_pages();
+  tt_tiered();
+  tt_mapped();
+  tt_direct();
+  tt_interned();
+  tt_memory();
+  tt_steal();
+  tt_bulk();
+  tt_async();
+  tt_clone();
+
   // kvfifo<int, mv> q{};
   // for (size_t i = 0; i < 10; i++) {
   //   q.push(i, {});